@@ -5,4 +5,5 @@ void cmd_cache();
 void cmd_topology();
 void cmd_features();
 void cmd_pstates();
-void cmd_full();
\ No newline at end of file
+void cmd_full();
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
\ No newline at end of file
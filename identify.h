@@ -123,6 +123,8 @@ inline void write_mem32(uint64_t addr, uint32_t value) {
 #define ATA_CMD_WRITE_DMA_EXT    0x35    // WRITE DMA EXT (LBA48)
 #define ATA_CMD_FLUSH_CACHE      0xE7    // FLUSH CACHE
 #define ATA_CMD_FLUSH_CACHE_EXT  0xEA    // FLUSH CACHE EXT
+#define ATA_CMD_DSM              0x06    // DATA SET MANAGEMENT (feature 0x01 = TRIM)
+#define ATA_DSM_TRIM             0x01
 
 
 
@@ -494,6 +496,30 @@ int prepare_port_for_command(uint64_t port_addr, int port) {
     return 0; // Port is ready
 }
 
+// --- Background commands ---
+// At most one read may be left running while the caller does other work. All commands
+// share cmd_table_buffer, so every other command first waits for it to finish; its result
+// is kept until the owner collects it with ahci_async_wait().
+typedef struct {
+    bool active;
+    uint64_t port_addr;
+    int slot;
+    uint32_t bytes;
+    int status;       // Result of the last background command once it has completed
+} ahci_async_t;
+
+static ahci_async_t ahci_async;
+
+// Waits for the background command, if any. Returns its result (0 on success).
+int ahci_async_wait() {
+    if (ahci_async.active) {
+        ahci_async.active = false;
+        hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(cmd_list_buffer + (ahci_async.slot * sizeof(hba_cmd_header_t)));
+        ahci_async.status = wait_for_ahci_completion(ahci_async.port_addr, ahci_async.slot, cmd_header, ahci_async.bytes);
+    }
+    return ahci_async.status;
+}
+
 // Function to display IDENTIFY data in a readable format
 
 // DEBUG: Assumes iostream_wrapper can handle basic types and C-style strings.
@@ -760,6 +786,7 @@ void display_identify_data(uint16_t* data) {
 // Returns 0 on success, negative on error
 
 int send_identify_command(uint64_t ahci_base, int port) {
+    ahci_async_wait();
 
     // DEBUG: Validate port number against HBA capabilities (e.g., read HBA_CAP register)
 
@@ -891,6 +918,7 @@ int send_identify_command(uint64_t ahci_base, int port) {
 // buffer: Pointer to a DMA-accessible buffer to store the data (must be large enough: count * SECTOR_SIZE)
 // Returns 0 on success, negative on error
 int read_sectors(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, void* buffer) {
+    ahci_async_wait();
     uint64_t port_addr = ahci_base + 0x100 + (port * 0x80);
     uint8_t command = 0;
     bool use_lba48 = false;
@@ -1022,6 +1050,7 @@ int read_sectors(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, voi
 // buffer: Pointer to a DMA-accessible buffer containing the data (must be count * SECTOR_SIZE bytes)
 // Returns 0 on success, negative on error
 int write_sectors(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, void* buffer) {
+    ahci_async_wait();
     uint64_t port_addr = ahci_base + 0x100 + (port * 0x80);
     uint8_t command = 0;
     bool use_lba48 = false;
@@ -1149,6 +1178,208 @@ int write_sectors(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, vo
 }
 
 
+// --- Drive capabilities and extra ATA commands ---
+
+// Parsed IDENTIFY DEVICE data, filled in by ata_identify().
+typedef struct {
+    bool     valid;
+    bool     lba48;
+    uint64_t total_sectors;        // User-addressable logical sectors
+    uint32_t logical_sector_size;  // Bytes
+    uint32_t physical_sector_size; // Bytes
+    uint32_t alignment_offset;     // Logical sectors before the first physical sector boundary
+    bool     trim;                 // DATA SET MANAGEMENT / TRIM supported (word 169)
+    bool     trim_reads_zero;      // Trimmed sectors read back as zeroes (word 69, DRAT + RZAT)
+    uint16_t dsm_max_blocks;       // 512-byte blocks of range entries per DSM command (word 105)
+} ata_drive_info_t;
+
+static ata_drive_info_t ata_drive_info;
+
+// Builds and issues a command with at most one PRDT entry without waiting for it.
+// 'bytes' may be 0 for non-data commands; 'write' selects the host-to-device data
+// direction. The FIS always uses 48-bit layout. Returns the slot, negative on error
+int ahci_issue_command(uint64_t ahci_base, int port, uint8_t command, uint16_t features,
+                       uint64_t lba, uint16_t count, void* buffer, uint32_t bytes, bool write) {
+    uint64_t port_addr = ahci_base + 0x100 + (port * 0x80);
+    ahci_async_wait();
+
+    if (bytes > MAX_TRANSFER_SECTORS * SECTOR_SIZE || (bytes > 0 && !buffer)) return -11;
+
+    int prep_status = prepare_port_for_command(port_addr, port);
+    if (prep_status < 0) {
+        return prep_status;
+    }
+
+    int slot = find_free_command_slot(port_addr);
+    if (slot < 0) {
+        cout << "ERROR: No free command slot found on port " << port << ".\n";
+        return -5;
+    }
+
+    uint64_t cmd_list_phys = (uint64_t)cmd_list_buffer;
+    uint64_t fis_buffer_phys = (uint64_t)fis_buffer;
+    uint64_t cmd_table_phys = (uint64_t)cmd_table_buffer;
+    write_mem32(port_addr + PORT_CLB, (uint32_t)cmd_list_phys);
+    write_mem32(port_addr + PORT_CLBU, (uint32_t)(cmd_list_phys >> 32));
+    write_mem32(port_addr + PORT_FB, (uint32_t)fis_buffer_phys);
+    write_mem32(port_addr + PORT_FBU, (uint32_t)(fis_buffer_phys >> 32));
+
+    hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(cmd_list_buffer + (slot * sizeof(hba_cmd_header_t)));
+    hba_cmd_tbl_t* cmd_table = (hba_cmd_tbl_t*)cmd_table_buffer;
+    fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)cmd_table->cfis;
+
+    uint8_t* hdr_ptr = (uint8_t*)cmd_header;
+    for (size_t i = 0; i < sizeof(hba_cmd_header_t); i++) hdr_ptr[i] = 0;
+    uint8_t* tbl_ptr = (uint8_t*)cmd_table;
+    for (size_t i = 0; i < CMD_TABLE_STATIC_SIZE + 1 * sizeof(hba_prdt_entry_t); i++) tbl_ptr[i] = 0;
+
+    cmd_header->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t); // 5 DWORDs
+    cmd_header->w = write ? 1 : 0;
+    cmd_header->prdtl = (bytes > 0) ? 1 : 0;
+    cmd_header->ctba = cmd_table_phys;
+
+    if (bytes > 0) {
+        cmd_table->prdt[0].dba = (uint64_t)buffer;
+        cmd_table->prdt[0].dbc = bytes - 1; // 0-based count
+        cmd_table->prdt[0].i = 1;
+    }
+
+    cmdfis->fis_type = FIS_TYPE_REG_H2D;
+    cmdfis->c = 1;
+    cmdfis->command = command;
+    cmdfis->device = (1 << 6); // LBA mode
+    cmdfis->lba0 = (uint8_t)(lba & 0xFF);
+    cmdfis->lba1 = (uint8_t)((lba >> 8) & 0xFF);
+    cmdfis->lba2 = (uint8_t)((lba >> 16) & 0xFF);
+    cmdfis->lba3 = (uint8_t)((lba >> 24) & 0xFF);
+    cmdfis->lba4 = (uint8_t)((lba >> 32) & 0xFF);
+    cmdfis->lba5 = (uint8_t)((lba >> 40) & 0xFF);
+    cmdfis->countl = (uint8_t)(count & 0xFF);
+    cmdfis->counth = (uint8_t)((count >> 8) & 0xFF);
+    cmdfis->featurel = (uint8_t)(features & 0xFF);
+    cmdfis->featureh = (uint8_t)((features >> 8) & 0xFF);
+    cmdfis->control = 0;
+
+    int issue_status = issue_ahci_command(port_addr, slot);
+    if (issue_status < 0) {
+        return issue_status;
+    }
+    return slot;
+}
+
+// Issues a command and waits for it. Returns 0 on success, negative on error
+int ahci_exec_command(uint64_t ahci_base, int port, uint8_t command, uint16_t features,
+                      uint64_t lba, uint16_t count, void* buffer, uint32_t bytes, bool write) {
+    int slot = ahci_issue_command(ahci_base, port, command, features, lba, count, buffer, bytes, write);
+    if (slot < 0) {
+        return slot;
+    }
+    uint64_t port_addr = ahci_base + 0x100 + (port * 0x80);
+    hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(cmd_list_buffer + (slot * sizeof(hba_cmd_header_t)));
+    return wait_for_ahci_completion(port_addr, slot, cmd_header, bytes);
+}
+
+// Commits the drive's volatile write cache to the medium. Returns 0 on success
+int ata_flush_cache(uint64_t ahci_base, int port) {
+    uint8_t command = lba48_available ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE;
+    return ahci_exec_command(ahci_base, port, command, 0, 0, 0, nullptr, 0, false);
+}
+
+// Starts a READ DMA EXT in the background; collect it with ahci_async_wait(). Needs LBA48.
+// Returns 0 if the read was issued, negative on error
+int ahci_read_async(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, void* buffer) {
+    if (!lba48_available || count == 0 || count > MAX_TRANSFER_SECTORS) return -10;
+    uint32_t bytes = count * SECTOR_SIZE;
+    int slot = ahci_issue_command(ahci_base, port, ATA_CMD_READ_DMA_EXT, 0, lba, count, buffer, bytes, false);
+    if (slot < 0) {
+        return slot;
+    }
+    ahci_async.active = true;
+    ahci_async.port_addr = ahci_base + 0x100 + (port * 0x80);
+    ahci_async.slot = slot;
+    ahci_async.bytes = bytes;
+    ahci_async.status = 0;
+    return 0;
+}
+
+// Issues IDENTIFY DEVICE without printing anything and fills in ata_drive_info.
+// Returns 0 on success, negative on error
+int ata_identify(uint64_t ahci_base, int port) {
+    ata_drive_info.valid = false;
+    int status = ahci_exec_command(ahci_base, port, ATA_CMD_IDENTIFY, 0, 0, 0, data_buffer, SECTOR_SIZE, false);
+    if (status < 0) return status;
+
+    uint16_t* w = (uint16_t*)data_buffer;
+    ata_drive_info_t* info = &ata_drive_info;
+    info->lba48 = (w[83] & (1 << 10)) != 0;
+    lba48_available = info->lba48;
+    if (info->lba48) {
+        info->total_sectors = ((uint64_t)w[100]) | ((uint64_t)w[101] << 16) |
+                              ((uint64_t)w[102] << 32) | ((uint64_t)w[103] << 48);
+    } else {
+        info->total_sectors = ((uint32_t)w[61] << 16) | w[60];
+    }
+
+    // Word 106 is only meaningful when bits 15:14 read 01b.
+    bool w106_valid = (w[106] & 0xC000) == 0x4000;
+    info->logical_sector_size = SECTOR_SIZE;
+    if (w106_valid && (w[106] & (1 << 12))) {
+        info->logical_sector_size = (((uint32_t)w[118] << 16) | w[117]) * 2; // Words per sector
+    }
+    info->physical_sector_size = info->logical_sector_size;
+    if (w106_valid && (w[106] & (1 << 13))) {
+        info->physical_sector_size = info->logical_sector_size << (w[106] & 0x0F);
+    }
+    info->alignment_offset = ((w[209] & 0xC000) == 0x4000) ? (w[209] & 0x3FFF) : 0;
+
+    info->trim = (w[169] & 1) != 0;
+    info->trim_reads_zero = info->trim && (w[69] & (1 << 14)) && (w[69] & (1 << 5));
+    info->dsm_max_blocks = w[105] ? w[105] : 1;
+    info->valid = true;
+    return 0;
+}
+
+// A run of sectors for ata_trim_ranges().
+typedef struct {
+    uint64_t lba;
+    uint32_t count;
+} ata_trim_range_t;
+
+// Sends TRIM for every range, packing as many 8-byte range entries (48-bit LBA, 16-bit
+// length) into each DATA SET MANAGEMENT command as the drive accepts.
+// Returns 0 on success, -1 if TRIM is unsupported, other negatives on command errors.
+int ata_trim_ranges(uint64_t ahci_base, int port, const ata_trim_range_t* ranges, int range_count) {
+    if (!ata_drive_info.valid || !ata_drive_info.trim) return -1;
+    uint32_t max_blocks = ata_drive_info.dsm_max_blocks;
+    if (max_blocks > MAX_TRANSFER_SECTORS) max_blocks = MAX_TRANSFER_SECTORS;
+    const uint32_t entries_per_block = SECTOR_SIZE / 8;
+    uint64_t* entries = (uint64_t*)data_buffer;
+
+    int r = 0;
+    uint64_t lba = (range_count > 0) ? ranges[0].lba : 0;
+    uint32_t left = (range_count > 0) ? ranges[0].count : 0;
+    while (r < range_count) {
+        uint32_t used = 0;
+        while (r < range_count && used < max_blocks * entries_per_block) {
+            if (left == 0) {
+                if (++r < range_count) { lba = ranges[r].lba; left = ranges[r].count; }
+                continue;
+            }
+            uint32_t n = (left > 0xFFFF) ? 0xFFFF : left;
+            entries[used++] = (lba & 0x0000FFFFFFFFFFFFULL) | ((uint64_t)n << 48);
+            lba += n;
+            left -= n;
+        }
+        if (used == 0) break;
+        uint32_t blocks = (used + entries_per_block - 1) / entries_per_block;
+        for (uint32_t i = used; i < blocks * entries_per_block; i++) entries[i] = 0; // Unused entries
+        int status = ahci_exec_command(ahci_base, port, ATA_CMD_DSM, ATA_DSM_TRIM, 0, blocks,
+                                       data_buffer, blocks * SECTOR_SIZE, true);
+        if (status < 0) return status;
+    }
+    return 0;
+}
+
 // Helper function to calculate string length (like strlen)
 // Assumes null-terminated string.
 // WARNING: No buffer overflow check! Use with caution.
@@ -13,6 +13,11 @@ struct gdt_ptr gdtp;
 // --- KEYBOARD STATE ---
 static bool shift_pressed = false;
 
+// --- TIMER STATE ---
+volatile uint32_t timer_ticks = 0; // PIT interrupts since boot
+volatile uint32_t writeback_deadline = 0; // Tick at which dirty file system state is due, 0 = none
+volatile bool writeback_due = false;
+
 // --- SCANCODE CONSTANTS ---
 #define SCANCODE_L_SHIFT_PRESS 0x2A
 #define SCANCODE_R_SHIFT_PRESS 0x36
@@ -167,6 +172,12 @@ extern "C" void keyboard_handler() {
 
 // REPLACE timer_handler() to prevent blink glitch
 extern "C" void timer_handler() {
+    timer_ticks++;
+    if (writeback_deadline != 0 && (int32_t)(timer_ticks - writeback_deadline) >= 0) {
+        writeback_due = true;
+        writeback_deadline = 0;
+    }
+
     // Update Pong game if it's running
     if (is_pong_running()) {
         pong_update();
@@ -287,7 +298,7 @@ void init_pic() {
 
 /* Initialize PIT (Programmable Interval Timer) for cursor blinking */
 void init_pit() {
-    uint32_t divisor = 1193180 / 100; // 100 Hz timer frequency
+    uint32_t divisor = 1193180 / PIT_FREQUENCY_HZ;
     // Set command byte: channel 0, access mode lobyte/hibyte, mode 3 (square wave)
     outb(0x43, 0x36);
     // Send divisor (low byte first, then high byte)
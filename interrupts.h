@@ -13,6 +13,15 @@ extern struct gdt_ptr gdtp;
 extern const char scancode_to_ascii[128];
 extern const char extended_scancode_table[128];
 
+// PIT tick rate and the number of ticks since boot
+#define PIT_FREQUENCY_HZ 100
+extern volatile uint32_t timer_ticks;
+
+// Write-back timer: when timer_ticks reaches a non-zero deadline the timer handler sets
+// writeback_due; the flush itself runs later, outside interrupt context.
+extern volatile uint32_t writeback_deadline;
+extern volatile bool writeback_due;
+
 // Initialize interrupt-related components
 void init_pic();
 void init_pit();
@@ -4,6 +4,7 @@
 // Global instances
 TerminalOutput cout;
 TerminalInput cin;
+void (*input_idle_hook)() = nullptr;
 
 // Add this implementation for the new operator
 TerminalOutput& TerminalOutput::operator<<(TerminalOutput& (*manip)(TerminalOutput&)) {
@@ -313,6 +314,8 @@ TerminalInput& TerminalInput::operator>>(char* str) {
     
     // Wait for input to be ready (set by keyboard interrupt)
     while (!input_ready) {
+        if (input_idle_hook) input_idle_hook();
+        if (input_ready) break;
         asm volatile ("hlt"); // Wait for input
     }
     
@@ -81,6 +81,8 @@ public:
 // Global instances
 extern TerminalOutput cout;
 extern TerminalInput cin;
+// Called on each wakeup while cin waits for a line (background work such as write-back)
+extern void (*input_idle_hook)();
 // Initialization function
 void init_terminal_io();
 #endif // IOSTREAM_WRAPPER_H
\ No newline at end of file
@@ -31,6 +31,7 @@ void cmd_notepad(unsigned long long, int, char const*);
 #define SECTOR_SIZE 512
 #define ENTRY_SIZE 32
 #define ATTR_LONG_NAME 0x0F
+#define ATTR_HIDDEN 0x02
 #define ATTR_DIRECTORY 0x10
 #define ATTR_VOLUME_ID 0x08
 #define ATTR_ARCHIVE 0x20
@@ -47,6 +48,9 @@ static const uint32_t FAT_BAD_CLUSTER  = 0x0FFFFFF7;
 // --- Add to FORWARD DECLARATIONS ---
 int fat32_rename_file(uint64_t ahci_base, int port, const char* old_name, const char* new_name);
 int fat32_copy_file(uint64_t ahci_base, int port, const char* src_name, const char* dest_name);
+int fat32_chdir(uint64_t ahci_base, int port, const char* path);
+int fat32_mkdir(uint64_t ahci_base, int port, const char* path);
+int fat32_rmdir(uint64_t ahci_base, int port, const char* path);
 
 
 // --- FORWARD DECLARATIONS ---
@@ -58,17 +62,25 @@ static inline int stricmp(const char* s1, const char* s2);
 
 static inline char* simple_strchr(const char* s, int c);
 static inline char* simple_strcat(char* dest, const char* src);
+static inline uint32_t simple_atou(const char* s);
 
 // FAT32 Helpers
 static void to_83_format(const char* filename, char* out);
 void from_83_format(const char* fat_name, char* out);
 static inline uint64_t cluster_to_lba(uint32_t cluster);
+static inline uint32_t fat32_max_clusters();
 uint32_t clusters_needed(uint32_t size);
 
 // Core FAT32 Functions
 bool fat32_init(uint64_t ahci_base, int port);
 uint32_t read_fat_entry(uint64_t ahci_base, int port, uint32_t cluster);
 bool write_fat_entry(uint64_t ahci_base, int port, uint32_t cluster, uint32_t value);
+bool fat32_flush_fat(uint64_t ahci_base, int port);
+bool fat32_write_fsinfo(uint64_t ahci_base, int port);
+bool fat32_sync_fat_mirrors(uint64_t ahci_base, int port);
+bool fat32_sync(uint64_t ahci_base, int port);
+bool fat32_trim_pending(uint64_t ahci_base, int port);
+int fat32_fstrim(uint64_t ahci_base, int port);
 uint32_t find_free_cluster(uint64_t ahci_base, int port, uint32_t start_cluster);
 uint32_t allocate_cluster(uint64_t ahci_base, int port);
 uint32_t allocate_cluster_chain(uint64_t ahci_base, int port, uint32_t num_clusters);
@@ -77,12 +89,33 @@ bool read_data_from_clusters(uint64_t ahci_base, int port, uint32_t start_cluste
 bool write_data_to_clusters(uint64_t ahci_base, int port, uint32_t start_cluster, const void* data, uint32_t size);
 
 // File Operations
-void fat32_list_files(uint64_t ahci_base, int port);
+void fat32_list_files(uint64_t ahci_base, int port, const char* path);
 void fat32_read_file(uint64_t ahci_base, int port, const char* filename);
 int fat32_add_file(uint64_t ahci_base, int port, const char* filename, const void* data, uint32_t size);
 int fat32_remove_file(uint64_t ahci_base, int port, const char* filename);
 int fat32_read_file_to_buffer(uint64_t ahci_base, int port, const char* filename, void* data_buffer, uint32_t buffer_size);
 int fat32_write_file(uint64_t ahci_base, int port, const char* filename, const void* data, uint32_t size);
+int fat32_append_file(uint64_t ahci_base, int port, const char* filename, const void* data, uint32_t size);
+int fat32_set_compressed(uint64_t ahci_base, int port, const char* filename, bool compress);
+int fat32_sum_file(uint64_t ahci_base, int port, const char* filename, uint32_t* crc);
+void cmd_scrub(uint64_t ahci_base, int port, bool save);
+
+// File Handles
+int fat32_open(uint64_t ahci_base, int port, const char* filename, bool create);
+int fat32_read(uint64_t ahci_base, int port, int fd, void* buffer, uint32_t length);
+int fat32_write(uint64_t ahci_base, int port, int fd, const void* buffer, uint32_t length);
+int fat32_seek(int fd, uint32_t offset);
+int fat32_close(uint64_t ahci_base, int port, int fd);
+void fat32_close_all_files();
+
+// exFAT
+bool exfat_mount(uint64_t ahci_base, int port, const uint8_t* boot_sector);
+bool exfat_sync(uint64_t ahci_base, int port);
+void exfat_list_files(uint64_t ahci_base, int port, const char* path);
+void exfat_cat(uint64_t ahci_base, int port, const char* path);
+int exfat_remove_file(uint64_t ahci_base, int port, const char* path);
+int exfat_touch(uint64_t ahci_base, int port, const char* path, const void* data, uint32_t size, bool replace);
+int exfat_copy_file(uint64_t ahci_base, int port, const char* src_path, const char* dest_path);
 
 // Commands
 void cmd_help();
@@ -144,6 +177,7 @@ static uint32_t fat_start_sector = 0;
 static uint32_t data_start_sector = 0;
 static uint32_t current_directory_cluster = 2;
 static uint32_t next_free_cluster = 3;
+static bool exfat_mounted = false; // The mounted volume is exFAT; the FAT32 state is idle
 uint64_t ahci_base;
 DMAManager dma_manager;
 
@@ -154,12 +188,14 @@ static inline int simple_memcmp(const void* s1, const void* s2, size_t n) { cons
 
 static inline char* simple_strchr(const char* s, int c) { while (*s != (char)c) if (!*s++) return nullptr; return (char*)s; }
 static inline char* simple_strcat(char* dest, const char* src) { char* ptr = dest + simple_strlen(dest); while (*src != '\0') *ptr++ = *src++; *ptr = '\0'; return dest; }
+static inline uint32_t simple_atou(const char* s) { uint32_t v = 0; while (*s >= '0' && *s <= '9') v = v * 10 + (*s++ - '0'); return v; }
 static inline int stricmp(const char* s1, const char* s2) { while (*s1 && *s2) { char c1 = (*s1 >= 'A' && *s1 <= 'Z') ? *s1 + 32 : *s1; char c2 = (*s2 >= 'A' && *s2 <= 'Z') ? *s2 + 32 : *s2; if (c1 != c2) return c1 - c2; s1++; s2++; } return *s1 - *s2; }
 
 // --- FAT32 HELPER IMPLEMENTATIONS ---
 static void to_83_format(const char* filename, char* out) { simple_memset(out, ' ', 11); uint8_t i = 0, j = 0; while (filename[i] && filename[i] != '.' && j < 8) { char c = filename[i++]; out[j++] = (c >= 'a' && c <= 'z') ? c - 32 : c; } if (filename[i] == '.') i++; j = 8; while (filename[i] && j < 11) { char c = filename[i++]; out[j++] = (c >= 'a' && c <= 'z') ? c - 32 : c; } }
 void from_83_format(const char* fat_name, char* out) { int i, j = 0; for (i = 0; i < 8 && fat_name[i] != ' '; i++) out[j++] = fat_name[i]; if (fat_name[8] != ' ') { out[j++] = '.'; for (i = 8; i < 11 && fat_name[i] != ' '; i++) out[j++] = fat_name[i]; } out[j] = '\0'; }
 static inline uint64_t cluster_to_lba(uint32_t cluster) { if (cluster < 2) return 0; return data_start_sector + ((uint64_t)(cluster - 2) * fat32_bpb.sec_per_clus); }
+static inline uint32_t fat32_max_clusters() { return (fat32_bpb.tot_sec32 - data_start_sector) / fat32_bpb.sec_per_clus + 2; }
 uint32_t clusters_needed(uint32_t size) { uint32_t cluster_size = fat32_bpb.sec_per_clus * fat32_bpb.bytes_per_sec; return (size + cluster_size - 1) / cluster_size; }
 
 
@@ -168,24 +204,37 @@ uint32_t clusters_needed(uint32_t size) { uint32_t cluster_size = fat32_bpb.sec_
 
 // A memory-efficient bitmap class to track cluster usage.
 // Uses 1 bit per cluster instead of 1 byte, reducing memory usage by 8x.
+// Bits are stored in 32-bit words so searches can skip 32 clusters at a time.
 class Bitmap {
 private:
-    uint8_t* buffer;
+    uint32_t* buffer;
     size_t size_in_bits;
+    bool owns_buffer;
 
 public:
-    Bitmap(size_t bits) : size_in_bits(bits) {
-        // Calculate size in bytes, rounding up.
-        size_t buffer_size = (bits + 7) / 8;
-        buffer = new uint8_t[buffer_size];
+    Bitmap() : buffer(nullptr), size_in_bits(0), owns_buffer(false) {}
+
+    Bitmap(size_t bits) : size_in_bits(bits), owns_buffer(true) {
+        // Calculate size in words, rounding up.
+        size_t buffer_size = (bits + 31) / 32;
+        buffer = new uint32_t[buffer_size];
         if (buffer) {
             // Clear the bitmap initially.
-            simple_memset(buffer, 0, buffer_size);
+            simple_memset(buffer, 0, buffer_size * sizeof(uint32_t));
         }
     }
 
     ~Bitmap() {
-        delete[] buffer;
+        if (owns_buffer) delete[] buffer;
+    }
+
+    // Uses caller-provided storage of at least (bits + 31) / 32 words and clears it.
+    void attach(uint32_t* storage, size_t bits) {
+        if (owns_buffer) delete[] buffer;
+        buffer = storage;
+        size_in_bits = bits;
+        owns_buffer = false;
+        simple_memset(buffer, 0, ((bits + 31) / 32) * sizeof(uint32_t));
     }
 
     // Returns true if the memory was successfully allocated.
@@ -193,218 +242,1096 @@ public:
         return buffer != nullptr;
     }
 
+    size_t size() const {
+        return size_in_bits;
+    }
+
     // Set a bit to 1 (true).
     void set(size_t bit) {
         if (bit >= size_in_bits) return;
-        buffer[bit / 8] |= (1 << (bit % 8));
+        buffer[bit / 32] |= (1u << (bit % 32));
+    }
+
+    // Clear a bit to 0 (false).
+    void clear(size_t bit) {
+        if (bit >= size_in_bits) return;
+        buffer[bit / 32] &= ~(1u << (bit % 32));
     }
 
     // Test if a bit is 1.
     bool test(size_t bit) const {
         if (bit >= size_in_bits) return false;
-        return (buffer[bit / 8] & (1 << (bit % 8))) != 0;
+        return (buffer[bit / 32] & (1u << (bit % 32))) != 0;
+    }
+
+    // Raw access to 32 bits at once, for word-at-a-time comparisons.
+    uint32_t word(size_t index) const {
+        return buffer[index];
+    }
+
+    // Returns the first 0 bit at or after 'start', or size() if there is none.
+    // Full words are skipped in one compare; the bit within a word is found with bsf.
+    size_t find_first_clear(size_t start) const {
+        if (start >= size_in_bits) return size_in_bits;
+        size_t word = start / 32;
+        size_t words = (size_in_bits + 31) / 32;
+        uint32_t candidates = ~buffer[word] & (0xFFFFFFFFu << (start % 32));
+        while (candidates == 0) {
+            if (++word >= words) return size_in_bits;
+            candidates = ~buffer[word];
+        }
+        size_t bit = word * 32 + __builtin_ctz(candidates);
+        return (bit < size_in_bits) ? bit : size_in_bits;
+    }
+
+    // Counts consecutive 0 bits starting at 'start', stopping at max_len.
+    size_t clear_run_length(size_t start, size_t max_len) const {
+        if (start >= size_in_bits) return 0;
+        size_t end = (max_len < size_in_bits - start) ? start + max_len : size_in_bits;
+        size_t bit = start;
+        while (bit < end) {
+            if (bit % 32 == 0 && end - bit >= 32 && buffer[bit / 32] == 0) { bit += 32; continue; }
+            if (buffer[bit / 32] & (1u << (bit % 32))) break;
+            bit++;
+        }
+        return bit - start;
     }
 };
 
 
-// --- Helper function for chkdsk (now uses the Bitmap) ---
-void scan_directory_for_chkdsk(uint64_t ahci_base, int port, uint32_t dir_cluster, Bitmap& cluster_map, uint32_t max_clusters) {
-    if (dir_cluster < 2 || dir_cluster >= max_clusters) return;
-    
-    uint8_t buffer[SECTOR_SIZE];
-    uint32_t current_dir_cluster = dir_cluster;
+// --- DIRECTORY ITERATOR ---
+// Walks a directory a sector of entries at a time across its whole cluster chain, for
+// dir_scan_sector() to classify. Each cluster is fetched with one read into
+// dir_cluster_buffer, so scans run at sequential-read speed. Only one iteration may be in
+// progress at a time.
+#define ENTRIES_PER_SECTOR (SECTOR_SIZE / ENTRY_SIZE)
 
-    while (current_dir_cluster >= 2 && current_dir_cluster < FAT_BAD_CLUSTER) {
-        // Mark the directory cluster itself as used
-        cluster_map.set(current_dir_cluster);
+typedef struct {
+    uint32_t lba;  // Sector holding the entry
+    uint16_t slot; // Entry index within that sector
+} dir_pos_t;
 
-        uint64_t lba = cluster_to_lba(current_dir_cluster);
-        for (uint8_t s = 0; s < fat32_bpb.sec_per_clus; s++) {
-            if (read_sectors(ahci_base, port, lba + s, 1, buffer) != 0) return;
-            for (uint16_t e = 0; e < SECTOR_SIZE / ENTRY_SIZE; e++) {
-                fat_dir_entry_t *entry = (fat_dir_entry_t *)(buffer + e * ENTRY_SIZE);
+typedef struct {
+    uint32_t cluster; // Cluster being walked; the last cluster once the chain is exhausted
+    uint32_t index;   // Next entry index within 'cluster'
+    uint32_t hops;    // Clusters visited, bounds the walk on a looping chain
+    bool error;       // Iteration stopped on a read error or a broken chain
+} dir_iter_t;
 
-                if (entry->name[0] == 0x00) {
-                    current_dir_cluster = FAT_END_OF_CHAIN;
-                    break;
-                }
-                if (entry->name[0] == DELETED_ENTRY) continue;
-
-                uint32_t file_cluster = (entry->fst_clus_hi << 16) | entry->fst_clus_lo;
-                
-                if ((entry->attr & ATTR_DIRECTORY) && entry->name[0] != '.') {
-                    scan_directory_for_chkdsk(ahci_base, port, file_cluster, cluster_map, max_clusters);
-                } else {
-                    uint32_t current_file_cluster = file_cluster;
-                    while (current_file_cluster >= 2 && current_file_cluster < FAT_BAD_CLUSTER) {
-                        cluster_map.set(current_file_cluster);
-                        current_file_cluster = read_fat_entry(ahci_base, port, current_file_cluster);
-                    }
-                }
-            }
+static uint8_t dir_cluster_buffer[MAX_TRANSFER_SECTORS * SECTOR_SIZE] __attribute__((aligned(4)));
+static uint32_t dir_buffer_cluster = 0; // Cluster held in dir_cluster_buffer, 0 if none
+
+static inline uint32_t dir_entries_per_cluster() { return fat32_bpb.sec_per_clus * ENTRIES_PER_SECTOR; }
+
+static inline dir_pos_t dir_pos_at(uint32_t cluster, uint32_t index) {
+    dir_pos_t pos;
+    pos.lba = (uint32_t)cluster_to_lba(cluster) + index / ENTRIES_PER_SECTOR;
+    pos.slot = index % ENTRIES_PER_SECTOR;
+    return pos;
+}
+
+static void dir_iter_start(dir_iter_t* it, uint32_t first_cluster) {
+    it->cluster = first_cluster;
+    it->index = 0;
+    it->hops = 0;
+    it->error = false;
+    dir_buffer_cluster = 0; // Always start from what is on disk
+}
+
+// Moves the iterator onto the cluster holding its next entry and makes sure that cluster
+// is in dir_cluster_buffer. Returns false at the end of the chain or on error.
+static bool dir_iter_load(uint64_t ahci_base, int port, dir_iter_t* it) {
+    if (it->error) return false;
+    uint32_t max_clusters = fat32_max_clusters();
+    if (it->index >= dir_entries_per_cluster()) {
+        uint32_t next = read_fat_entry(ahci_base, port, it->cluster);
+        if (next > FAT_BAD_CLUSTER) return false; // End of chain
+        if (next < 2 || next >= max_clusters || ++it->hops >= max_clusters) { it->error = true; return false; }
+        it->cluster = next;
+        it->index = 0;
+    }
+    if (it->cluster < 2 || it->cluster >= max_clusters) { it->error = true; return false; }
+    if (dir_buffer_cluster != it->cluster) {
+        dir_buffer_cluster = 0;
+        if (read_sectors(ahci_base, port, cluster_to_lba(it->cluster), fat32_bpb.sec_per_clus, dir_cluster_buffer) != 0) {
+            it->error = true;
+            return false;
+        }
+        dir_buffer_cluster = it->cluster;
+    }
+    return true;
+}
+
+// Returns the next sector of raw entries (free and deleted slots included) and, if 'pos' is
+// given, the location of its first entry. Returns nullptr at the end of the chain or on
+// error. The pointer is only valid until the next call.
+static const uint8_t* dir_iter_next_sector(uint64_t ahci_base, int port, dir_iter_t* it, dir_pos_t* pos) {
+    if (!dir_iter_load(ahci_base, port, it)) return nullptr;
+    if (pos) *pos = dir_pos_at(it->cluster, it->index);
+    const uint8_t* sector = dir_cluster_buffer + it->index * ENTRY_SIZE;
+    it->index += ENTRIES_PER_SECTOR;
+    return sector;
+}
+
+// --- DIRECTORY SECTOR SCANNER ---
+// Classifies the 16 entries of a directory sector in one branch-free pass, one mask bit
+// per entry. Names are compared as three 32-bit words (the third masked to the three
+// extension bytes, since byte 11 is the attribute) against a target loaded once per
+// sector, instead of up to 11 byte compares per entry. Bits at and after the first
+// end-of-directory entry are cleared from every mask but 'end'.
+typedef struct {
+    uint32_t end;     // name[0] == 0x00
+    uint32_t deleted; // name[0] == 0xE5
+    uint32_t live;    // Files and directories: not free, deleted, long-name or volume label
+    uint32_t match;   // Live entries whose name equals the target
+} dir_scan_t;
+
+static inline uint32_t load_le32(const uint8_t* p) {
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Scans one sector; 'name' is an 8.3 name to match, or nullptr.
+static void dir_scan_sector(const uint8_t* sector, const char* name, dir_scan_t* scan) {
+    uint8_t target[12] = {0};
+    if (name) simple_memcpy(target, name, 11);
+    uint32_t t0 = load_le32(target), t1 = load_le32(target + 4), t2 = load_le32(target + 8);
+    uint32_t end = 0, deleted = 0, skip = 0, match = 0;
+    for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++) {
+        const uint32_t* w = (const uint32_t*)(sector + i * ENTRY_SIZE); // 4-byte aligned buffer
+        uint32_t first = w[0] & 0xFF;
+        end |= (uint32_t)(first == 0x00) << i;
+        deleted |= (uint32_t)(first == DELETED_ENTRY) << i;
+        skip |= (uint32_t)((w[2] >> 24 & ATTR_VOLUME_ID) != 0) << i; // Long names carry it too
+        match |= (uint32_t)(((w[0] ^ t0) | (w[1] ^ t1) | ((w[2] ^ t2) & 0x00FFFFFF)) == 0) << i;
+    }
+    uint32_t before_end = end ? (end & (0u - end)) - 1 : (1u << ENTRIES_PER_SECTOR) - 1;
+    scan->end = end;
+    scan->deleted = deleted & before_end;
+    scan->live = ~(end | deleted | skip) & before_end;
+    scan->match = name ? (match & scan->live) : 0;
+}
+
+// Appends a zeroed cluster to the directory chain ending at 'last_cluster'.
+// Returns the new cluster, or 0 if the disk is full.
+static uint32_t dir_extend(uint64_t ahci_base, int port, uint32_t last_cluster) {
+    uint32_t cluster = allocate_cluster(ahci_base, port); // Marked EOC and zero-filled
+    if (cluster == 0) return 0;
+    if (!write_fat_entry(ahci_base, port, last_cluster, cluster)) {
+        write_fat_entry(ahci_base, port, cluster, FAT_FREE_CLUSTER);
+        return 0;
+    }
+    simple_memset(dir_cluster_buffer, 0, fat32_bpb.sec_per_clus * SECTOR_SIZE);
+    dir_buffer_cluster = cluster;
+    return cluster;
+}
+
+// --- DIRECTORY INDEX ---
+// Name lookups in a directory go through an in-memory hash of 8.3 names that is built on
+// first access with one pass over the directory chain. DIR_INDEX_COUNT directories are
+// indexed at once and the least recently used index is rebuilt for a new one, so work
+// across a few directories (cp a/x b/y, path resolution) keeps every index warm. Each
+// slot keeps a copy of the on-disk entry and its location, so warm lookups need no disk
+// I/O. Every entry update goes through dir_write_entry(), which keeps the index coherent.
+#define DIR_INDEX_COUNT 4
+#define DIR_INDEX_SLOTS 8192 // Power of two
+#define DIR_INDEX_MAX_USED (DIR_INDEX_SLOTS * 3 / 4)
+#define DIR_INDEX_MAX_FREE 1024
+#define DIR_SLOT_EMPTY 0
+#define DIR_SLOT_USED 1
+#define DIR_SLOT_TOMBSTONE 2
+
+typedef struct {
+    uint8_t state;
+    dir_pos_t pos;
+    fat_dir_entry_t entry;
+} dir_index_slot_t;
+
+typedef struct {
+    bool valid;
+    uint32_t dir_cluster;   // 0 if the index holds no directory
+    uint32_t last_used;     // dir_index_clock at the last access, for LRU replacement
+    uint32_t used_slots;    // USED + TOMBSTONE slots; bounds probe lengths
+    uint32_t free_count;    // Deleted slots available in free_slots
+    bool free_overflow;     // More deleted slots exist than free_slots could hold
+    bool has_end;           // end_cluster/end_index name the first never-used slot
+    uint32_t end_cluster;
+    uint32_t end_index;     // Entry index within end_cluster
+    uint32_t last_cluster;  // Last cluster of the chain seen so far, for extending it
+    bool too_large;         // dir_cluster has more entries than the index can hold
+    dir_index_slot_t slots[DIR_INDEX_SLOTS];
+    dir_pos_t free_slots[DIR_INDEX_MAX_FREE];
+} dir_index_t;
+
+static dir_index_t dir_indexes[DIR_INDEX_COUNT];
+static uint32_t dir_index_clock = 0;
+
+static inline bool dir_entry_is_live(const fat_dir_entry_t* entry) {
+    uint8_t first = (uint8_t)entry->name[0];
+    if (first == 0x00 || first == DELETED_ENTRY) return false;
+    return (entry->attr & ATTR_LONG_NAME) != ATTR_LONG_NAME && !(entry->attr & ATTR_VOLUME_ID);
+}
+
+static uint32_t dir_name_hash(const char* name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < 11; i++) { hash ^= (uint8_t)name[i]; hash *= 16777619u; }
+    return hash;
+}
+
+static void dir_index_invalidate() {
+    for (uint32_t i = 0; i < DIR_INDEX_COUNT; i++) {
+        dir_indexes[i].valid = false;
+        dir_indexes[i].too_large = false;
+        dir_indexes[i].dir_cluster = 0;
+    }
+}
+
+// Returns the index holding 'dir_cluster', or nullptr if none does.
+static dir_index_t* dir_index_of(uint32_t dir_cluster) {
+    for (uint32_t i = 0; i < DIR_INDEX_COUNT; i++) if (dir_indexes[i].dir_cluster == dir_cluster) return &dir_indexes[i];
+    return nullptr;
+}
+
+// Drops the index of one directory, e.g. before its clusters are freed.
+static void dir_index_forget(uint32_t dir_cluster) {
+    dir_index_t* ix = dir_index_of(dir_cluster);
+    if (!ix) return;
+    ix->valid = false;
+    ix->too_large = false;
+    ix->dir_cluster = 0;
+}
+
+static dir_index_slot_t* dir_index_find(dir_index_t* ix, const char* name) {
+    uint32_t i = dir_name_hash(name) & (DIR_INDEX_SLOTS - 1);
+    for (uint32_t probes = 0; probes < DIR_INDEX_SLOTS; probes++, i = (i + 1) & (DIR_INDEX_SLOTS - 1)) {
+        dir_index_slot_t* slot = &ix->slots[i];
+        if (slot->state == DIR_SLOT_EMPTY) return nullptr;
+        if (slot->state == DIR_SLOT_USED && simple_memcmp(slot->entry.name, name, 11) == 0) return slot;
+    }
+    return nullptr;
+}
+
+static bool dir_index_insert(dir_index_t* ix, const fat_dir_entry_t* entry, dir_pos_t pos) {
+    uint32_t i = dir_name_hash(entry->name) & (DIR_INDEX_SLOTS - 1);
+    while (ix->slots[i].state == DIR_SLOT_USED) i = (i + 1) & (DIR_INDEX_SLOTS - 1);
+    if (ix->slots[i].state == DIR_SLOT_EMPTY) {
+        if (ix->used_slots >= DIR_INDEX_MAX_USED) return false;
+        ix->used_slots++;
+    }
+    ix->slots[i].state = DIR_SLOT_USED;
+    ix->slots[i].pos = pos;
+    simple_memcpy(&ix->slots[i].entry, entry, sizeof(fat_dir_entry_t));
+    return true;
+}
+
+static void dir_index_push_free(dir_index_t* ix, dir_pos_t pos) {
+    if (ix->free_count < DIR_INDEX_MAX_FREE) ix->free_slots[ix->free_count++] = pos;
+    else ix->free_overflow = true;
+}
+
+// Builds the index with one pass over the directory chain. Returns 0 on success, -1 on
+// read error, -2 if the directory has more entries than the index can hold.
+static int dir_index_build(uint64_t ahci_base, int port, dir_index_t* ix, uint32_t dir_cluster) {
+    ix->valid = false;
+    ix->too_large = false;
+    ix->dir_cluster = dir_cluster;
+    ix->used_slots = 0;
+    ix->free_count = 0;
+    ix->free_overflow = false;
+    ix->has_end = false;
+    for (uint32_t i = 0; i < DIR_INDEX_SLOTS; i++) ix->slots[i].state = DIR_SLOT_EMPTY;
+
+    dir_iter_t it;
+    dir_pos_t pos;
+    dir_scan_t scan;
+    const uint8_t* sector;
+    dir_iter_start(&it, dir_cluster);
+    while ((sector = dir_iter_next_sector(ahci_base, port, &it, &pos)) != nullptr) {
+        dir_scan_sector(sector, nullptr, &scan);
+        for (uint32_t bits = scan.deleted; bits; bits &= bits - 1) {
+            pos.slot = __builtin_ctz(bits);
+            dir_index_push_free(ix, pos);
         }
-        if (current_dir_cluster < FAT_BAD_CLUSTER) {
-             current_dir_cluster = read_fat_entry(ahci_base, port, current_dir_cluster);
+        for (uint32_t bits = scan.live; bits; bits &= bits - 1) {
+            pos.slot = __builtin_ctz(bits);
+            if (!dir_index_insert(ix, (const fat_dir_entry_t*)(sector + pos.slot * ENTRY_SIZE), pos)) { ix->too_large = true; return -2; }
         }
+        if (scan.end) {
+            ix->has_end = true;
+            ix->end_cluster = it.cluster;
+            ix->end_index = it.index - ENTRIES_PER_SECTOR + __builtin_ctz(scan.end);
+            break;
+        }
+    }
+    if (it.error) { ix->dir_cluster = 0; return -1; }
+    ix->last_cluster = it.cluster;
+    ix->valid = true;
+    return 0;
+}
+
+// Finds or builds the index of 'dir_cluster', replacing the least recently used one.
+// Sets *out and returns as dir_index_build().
+static int dir_index_ready(uint64_t ahci_base, int port, uint32_t dir_cluster, dir_index_t** out) {
+    dir_index_t* ix = dir_index_of(dir_cluster);
+    if (ix && (ix->valid || ix->too_large)) {
+        ix->last_used = ++dir_index_clock;
+        *out = ix;
+        return ix->valid ? 0 : -2;
     }
+    if (!ix) {
+        ix = &dir_indexes[0];
+        for (uint32_t i = 1; i < DIR_INDEX_COUNT; i++) if (dir_indexes[i].last_used < ix->last_used) ix = &dir_indexes[i];
+    }
+    ix->last_used = ++dir_index_clock;
+    *out = ix;
+    return dir_index_build(ahci_base, port, ix, dir_cluster);
 }
 
+// Moves the end-of-directory slot forward after it has been handed out, following the
+// chain into clusters that are already allocated.
+static void dir_index_advance_end(uint64_t ahci_base, int port, dir_index_t* ix) {
+    if (++ix->end_index < dir_entries_per_cluster()) return;
+    uint32_t next = read_fat_entry(ahci_base, port, ix->end_cluster);
+    if (next >= 2 && next < FAT_BAD_CLUSTER) {
+        ix->end_cluster = ix->last_cluster = next;
+        ix->end_index = 0;
+    } else {
+        ix->has_end = false;
+        ix->last_cluster = ix->end_cluster;
+    }
+}
 
-// --- The main chkdsk command (now uses the Bitmap) ---
-void cmd_chkdsk(uint64_t ahci_base, int port) {
-    cout << "Checking filesystem for errors...\n";
+// Finds a file or directory in directory 'dir_cluster' by 8.3 name. Deleted, long-name and
+// volume-label entries never match. Returns 0 on success, -1 on read error, -2 if absent.
+static int dir_lookup(uint64_t ahci_base, int port, uint32_t dir_cluster, const char* name, fat_dir_entry_t* entry, dir_pos_t* pos) {
+    dir_index_t* ix;
+    int status = dir_index_ready(ahci_base, port, dir_cluster, &ix);
+    if (status == -1) return -1;
+    if (status == 0) {
+        dir_index_slot_t* slot = dir_index_find(ix, name);
+        if (!slot) return -2;
+        simple_memcpy(entry, &slot->entry, sizeof(fat_dir_entry_t));
+        *pos = slot->pos;
+        return 0;
+    }
 
-    uint32_t total_data_sectors = fat32_bpb.tot_sec32 - data_start_sector;
-    uint32_t max_clusters = total_data_sectors / fat32_bpb.sec_per_clus + 2;
-    
-    // Use the memory-efficient Bitmap class for the cluster map.
-    Bitmap cluster_map(max_clusters);
-    if (!cluster_map.is_valid()) {
-        cout << "Error: Not enough memory to run chkdsk.\n";
+    // Too many entries to index: scan the chain.
+    dir_iter_t it;
+    dir_scan_t scan;
+    const uint8_t* sector;
+    dir_iter_start(&it, dir_cluster);
+    while ((sector = dir_iter_next_sector(ahci_base, port, &it, pos)) != nullptr) {
+        dir_scan_sector(sector, name, &scan);
+        if (scan.match) {
+            pos->slot = __builtin_ctz(scan.match);
+            simple_memcpy(entry, sector + pos->slot * ENTRY_SIZE, sizeof(fat_dir_entry_t));
+            return 0;
+        }
+        if (scan.end) return -2;
+    }
+    return it.error ? -1 : -2;
+}
+
+// Reserves a slot for a new entry: a deleted slot if one is known, else the end-of-directory
+// slot, else the first slot of a newly appended cluster. Returns 0 on success, -1 on read
+// error, -4 if the directory cannot grow because the disk is full.
+static int dir_alloc_slot(uint64_t ahci_base, int port, uint32_t dir_cluster, dir_pos_t* pos) {
+    dir_index_t* ix;
+    int status = dir_index_ready(ahci_base, port, dir_cluster, &ix);
+    // Deleted slots beyond what the free list could hold are found again by a rebuild.
+    if (status == 0 && ix->free_count == 0 && ix->free_overflow) status = dir_index_build(ahci_base, port, ix, dir_cluster);
+    if (status == -1) return -1;
+    if (status == 0) {
+        if (ix->free_count > 0) {
+            *pos = ix->free_slots[--ix->free_count];
+            return 0;
+        }
+        if (ix->has_end) {
+            *pos = dir_pos_at(ix->end_cluster, ix->end_index);
+            dir_index_advance_end(ahci_base, port, ix);
+            return 0;
+        }
+        uint32_t cluster = dir_extend(ahci_base, port, ix->last_cluster);
+        if (cluster == 0) return -4;
+        ix->last_cluster = ix->end_cluster = cluster;
+        ix->end_index = 1;
+        ix->has_end = true;
+        *pos = dir_pos_at(cluster, 0);
+        return 0;
+    }
+
+    // Too many entries to index: take the first free or deleted slot on the chain.
+    dir_iter_t it;
+    dir_scan_t scan;
+    const uint8_t* sector;
+    dir_iter_start(&it, dir_cluster);
+    while ((sector = dir_iter_next_sector(ahci_base, port, &it, pos)) != nullptr) {
+        dir_scan_sector(sector, nullptr, &scan);
+        if (scan.end | scan.deleted) {
+            pos->slot = __builtin_ctz(scan.end | scan.deleted);
+            return 0;
+        }
+    }
+    if (it.error) return -1;
+    uint32_t cluster = dir_extend(ahci_base, port, it.cluster);
+    if (cluster == 0) return -4;
+    *pos = dir_pos_at(cluster, 0);
+    return 0;
+}
+
+// Writes 'entry' at 'pos' in directory 'dir_cluster' and updates the index if it covers
+// that directory.
+// Sectors of the cluster held by the iterator are patched in place rather than re-read.
+// Returns 0 on success, -1 on read error, -2 on write error.
+static int dir_write_entry(uint64_t ahci_base, int port, uint32_t dir_cluster, dir_pos_t pos, const fat_dir_entry_t* entry) {
+    uint8_t buffer[SECTOR_SIZE];
+    uint8_t* sector = buffer;
+    uint32_t buffer_lba = dir_buffer_cluster ? (uint32_t)cluster_to_lba(dir_buffer_cluster) : 0;
+    if (dir_buffer_cluster && pos.lba >= buffer_lba && pos.lba < buffer_lba + fat32_bpb.sec_per_clus) {
+        sector = dir_cluster_buffer + (pos.lba - buffer_lba) * SECTOR_SIZE;
+    } else if (read_sectors(ahci_base, port, pos.lba, (uint32_t)1, buffer) != 0) {
+        return -1;
+    }
+    fat_dir_entry_t* slot_entry = (fat_dir_entry_t*)(sector + pos.slot * ENTRY_SIZE);
+    fat_dir_entry_t old_entry;
+    simple_memcpy(&old_entry, slot_entry, sizeof(fat_dir_entry_t));
+    simple_memcpy(slot_entry, entry, sizeof(fat_dir_entry_t));
+    if (write_sectors(ahci_base, port, pos.lba, (uint32_t)1, sector) != 0) {
+        dir_buffer_cluster = 0;
+        dir_index_invalidate();
+        return -2;
+    }
+
+    dir_index_t* ix = dir_index_of(dir_cluster);
+    if (!ix) return 0;
+    if (ix->valid) {
+        if (dir_entry_is_live(&old_entry)) {
+            dir_index_slot_t* slot = dir_index_find(ix, old_entry.name);
+            if (slot) slot->state = DIR_SLOT_TOMBSTONE;
+        }
+        if (dir_entry_is_live(entry)) {
+            if (!dir_index_insert(ix, entry, pos)) dir_index_forget(dir_cluster); // Rebuilt on next access
+        } else if ((uint8_t)entry->name[0] == DELETED_ENTRY) {
+            dir_index_push_free(ix, pos);
+        }
+    } else if (ix->too_large && !dir_entry_is_live(entry)) {
+        dir_index_forget(dir_cluster); // The directory may fit again
+    }
+    return 0;
+}
+
+
+// --- DENTRY CACHE AND PATHS ---
+// Paths are '/'-separated 8.3 names, absolute when they start with '/'. Directories met
+// while resolving them are cached as (parent cluster, 8.3 name) -> first cluster, which
+// links them into a tree below the root, so a deep path costs one hash probe per
+// component instead of a directory scan. Lookups fill the cache; rmdir and renames drop
+// the entries they change, mount clears it, and it is cleared whenever it fills up.
+#define DENTRY_SLOTS 1024 // Power of two
+#define DENTRY_MAX_USED (DENTRY_SLOTS * 3 / 4)
+#define PATH_MAX_LENGTH 256
+#define PATH_MAX_DEPTH 64 // Bound on the walk up from a directory to the root
+#define DOT_NAME    ".          "
+#define DOTDOT_NAME "..         "
+
+typedef struct {
+    uint8_t state;     // DIR_SLOT_*
+    uint32_t parent;   // First cluster of the directory holding the name
+    uint32_t cluster;  // First cluster of the named directory
+    char name[11];
+} dentry_t;
+
+static dentry_t dentry_cache[DENTRY_SLOTS];
+static uint32_t dentry_used = 0;
+static char current_path[PATH_MAX_LENGTH] = "/";
+
+static inline uint32_t dir_entry_cluster(const fat_dir_entry_t* entry) {
+    return ((uint32_t)entry->fst_clus_hi << 16) | entry->fst_clus_lo;
+}
+
+static inline uint32_t dentry_hash(uint32_t parent, const char* name) {
+    return (dir_name_hash(name) ^ (parent * 2654435761u)) & (DENTRY_SLOTS - 1);
+}
+
+static void dentry_clear() {
+    for (uint32_t i = 0; i < DENTRY_SLOTS; i++) dentry_cache[i].state = DIR_SLOT_EMPTY;
+    dentry_used = 0;
+}
+
+static dentry_t* dentry_find(uint32_t parent, const char* name) {
+    uint32_t i = dentry_hash(parent, name);
+    for (uint32_t probes = 0; probes < DENTRY_SLOTS; probes++, i = (i + 1) & (DENTRY_SLOTS - 1)) {
+        dentry_t* d = &dentry_cache[i];
+        if (d->state == DIR_SLOT_EMPTY) return nullptr;
+        if (d->state == DIR_SLOT_USED && d->parent == parent && simple_memcmp(d->name, name, 11) == 0) return d;
+    }
+    return nullptr;
+}
+
+static void dentry_insert(uint32_t parent, const char* name, uint32_t cluster) {
+    if (dentry_used >= DENTRY_MAX_USED) dentry_clear();
+    uint32_t i = dentry_hash(parent, name);
+    while (dentry_cache[i].state == DIR_SLOT_USED) i = (i + 1) & (DENTRY_SLOTS - 1);
+    if (dentry_cache[i].state == DIR_SLOT_EMPTY) dentry_used++;
+    dentry_cache[i].state = DIR_SLOT_USED;
+    dentry_cache[i].parent = parent;
+    dentry_cache[i].cluster = cluster;
+    simple_memcpy(dentry_cache[i].name, name, 11);
+}
+
+static void dentry_remove(uint32_t parent, const char* name) {
+    dentry_t* d = dentry_find(parent, name);
+    if (d) d->state = DIR_SLOT_TOMBSTONE;
+}
+
+// Steps from directory 'dir' into its subdirectory 'name' ("." and ".." included).
+// Returns 0 with the subdirectory's first cluster in *out, -1 on read error, -2 if there
+// is no such entry, -3 if it is not a directory.
+static int dir_step(uint64_t ahci_base, int port, uint32_t dir, const char* name, uint32_t* out) {
+    if (simple_memcmp(name, DOT_NAME, 11) == 0) { *out = dir; return 0; }
+    if (dir == fat32_bpb.root_clus && simple_memcmp(name, DOTDOT_NAME, 11) == 0) { *out = dir; return 0; }
+    dentry_t* d = dentry_find(dir, name);
+    if (d) { *out = d->cluster; return 0; }
+    fat_dir_entry_t entry;
+    dir_pos_t pos;
+    int status = dir_lookup(ahci_base, port, dir, name, &entry, &pos);
+    if (status != 0) return status;
+    if (!(entry.attr & ATTR_DIRECTORY)) return -3;
+    uint32_t cluster = dir_entry_cluster(&entry);
+    if (cluster == 0) cluster = fat32_bpb.root_clus; // ".." of a top-level directory
+    dentry_insert(dir, name, cluster);
+    *out = cluster;
+    return 0;
+}
+
+// Returns 1 if directory 'dir' is 'ancestor' or lies below it, 0 if not, -1 on read error.
+static int dir_is_within(uint64_t ahci_base, int port, uint32_t dir, uint32_t ancestor) {
+    for (uint32_t depth = 0; depth < PATH_MAX_DEPTH; depth++) {
+        if (dir == ancestor) return 1;
+        if (dir == fat32_bpb.root_clus) return 0;
+        if (dir_step(ahci_base, port, dir, DOTDOT_NAME, &dir) != 0) return -1;
+    }
+    return 1; // Too deep to tell, so assume it is
+}
+
+// Converts a path component of 'length' characters to an 8.3 name; "." and ".." are kept.
+static void path_component_83(const char* component, uint32_t length, char* out) {
+    if ((length == 1 || length == 2) && component[0] == '.' && component[length - 1] == '.') {
+        simple_memcpy(out, length == 1 ? DOT_NAME : DOTDOT_NAME, 11);
         return;
     }
+    char name[13];
+    if (length > 12) length = 12;
+    simple_memcpy(name, component, length);
+    name[length] = '\0';
+    to_83_format(name, out);
+}
+
+// Resolves every component of 'path' but the last. The directory holding the last one is
+// stored in *dir and its 8.3 name in 'name' ("." for "/" or an empty path). Returns 0 on
+// success, -1 on read error, -2 if a directory along the way is missing.
+static int path_resolve_parent(uint64_t ahci_base, int port, const char* path, uint32_t* dir, char* name) {
+    uint32_t cluster = (path[0] == '/') ? fat32_bpb.root_clus : current_directory_cluster;
+    const char* last = nullptr;
+    uint32_t last_length = 0;
+    while (*path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+        const char* end = path;
+        while (*end && *end != '/') end++;
+        if (last) {
+            char step[11];
+            path_component_83(last, last_length, step);
+            int status = dir_step(ahci_base, port, cluster, step, &cluster);
+            if (status != 0) return (status == -1) ? -1 : -2;
+        }
+        last = path;
+        last_length = end - path;
+        path = end;
+    }
+    *dir = cluster;
+    if (last) path_component_83(last, last_length, name);
+    else simple_memcpy(name, DOT_NAME, 11);
+    return 0;
+}
 
-    cout << "Phase 1: Verifying files and directories...\n";
-    scan_directory_for_chkdsk(ahci_base, port, fat32_bpb.root_clus, cluster_map, max_clusters);
-    
-    cout << "Phase 2: Verifying file allocation table...\n";
-    uint32_t orphaned_clusters_found = 0;
-    for (uint32_t cluster = 2; cluster < max_clusters; cluster++) {
-        uint32_t fat_entry = read_fat_entry(ahci_base, port, cluster);
+// Resolves 'path' to a directory. Returns 0 with its first cluster in *dir, -1 on read
+// error, -2 if it does not exist or is not a directory.
+static int path_resolve_dir(uint64_t ahci_base, int port, const char* path, uint32_t* dir) {
+    uint32_t parent;
+    char name[11];
+    int status = path_resolve_parent(ahci_base, port, path, &parent, name);
+    if (status != 0) return status;
+    status = dir_step(ahci_base, port, parent, name, dir);
+    if (status == 0 || status == -1) return status;
+    return -2;
+}
 
-        // If the FAT says this cluster is in use, but our map says it's not...
-        if (fat_entry != FAT_FREE_CLUSTER && !cluster_map.test(cluster)) {
-            cout << "Found orphaned cluster: " << cluster << ". Reclaiming...\n";
-            write_fat_entry(ahci_base, port, cluster, FAT_FREE_CLUSTER);
-            orphaned_clusters_found++;
+// Applies 'path' to the text of current_path: ".." drops the last component, "." is
+// skipped and other names are appended in display form. Returns false if it gets too long.
+static bool path_update_current(const char* path) {
+    char updated[PATH_MAX_LENGTH];
+    if (path[0] == '/') { updated[0] = '/'; updated[1] = '\0'; }
+    else simple_memcpy(updated, current_path, PATH_MAX_LENGTH);
+    while (*path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+        const char* end = path;
+        while (*end && *end != '/') end++;
+        char name[11];
+        path_component_83(path, end - path, name);
+        path = end;
+        uint32_t length = simple_strlen(updated);
+        if (simple_memcmp(name, DOT_NAME, 11) == 0) continue;
+        if (simple_memcmp(name, DOTDOT_NAME, 11) == 0) {
+            while (length > 1 && updated[length - 1] != '/') length--;
+            if (length > 1) length--; // Drop the separator too, but keep the root
+            updated[length] = '\0';
+            continue;
         }
+        char display[13];
+        from_83_format(name, display);
+        uint32_t display_length = simple_strlen(display);
+        if (length + 1 + display_length >= PATH_MAX_LENGTH) return false;
+        if (length > 1) updated[length++] = '/';
+        simple_memcpy(updated + length, display, display_length + 1);
     }
+    simple_memcpy(current_path, updated, PATH_MAX_LENGTH);
+    return true;
+}
 
-    if (orphaned_clusters_found > 0) {
-        cout << "\nCHKDSK finished. Reclaimed " << orphaned_clusters_found << " orphaned clusters.\n";
-    } else {
-        cout << "\nCHKDSK finished. No errors found.\n";
+
+
+// --- WRITE-BACK ---
+// FAT updates, FSInfo and small file writes stay in memory until a sync point: the 'sync'
+// and 'unmount' commands, or an idle flush once the oldest change is writeback_age_ms old.
+// The PIT handler raises writeback_due at the deadline and the shell's input wait loop
+// runs fat32_sync(). Only sync points ask the drive to flush its own write cache.
+static uint32_t writeback_age_ms = 5000;
+
+// Starts the age timer at the first change after a sync.
+static inline void writeback_arm() {
+    if (writeback_deadline == 0 && !writeback_due) {
+        uint32_t deadline = timer_ticks + writeback_age_ms / (1000 / PIT_FREQUENCY_HZ);
+        writeback_deadline = deadline ? deadline : 1;
     }
 }
 
-// Renames a file by finding its directory entry and changing the name field.
-int fat32_rename_file(uint64_t ahci_base, int port, const char* old_name, const char* new_name) {
+// --- FAT SECTOR CACHE ---
+// The FAT is cached in blocks of FAT_CACHE_BLOCK_SECTORS sectors so chain walks and
+// free-cluster scans run from memory. Entries are written back only on flush or
+// eviction, as one multi-sector command covering the dirty sectors. Only FAT #1 is
+// written then; the granules it touched are marked stale and copied to the other FATs
+// in bulk by fat32_sync_fat_mirrors(). While any mirror is stale the BPB's ext_flags say
+// mirroring is off with FAT #1 active, so other systems (and our next mount) trust FAT #1.
+#define FAT_CACHE_BLOCKS 32
+#define FAT_CACHE_BLOCK_SECTORS 8 // Must fit in dirty_mask
+#define FAT_MIRROR_GRANULE_SECTORS MAX_TRANSFER_SECTORS // Multiple of FAT_CACHE_BLOCK_SECTORS
+#define FAT_MIRROR_MAX_GRANULES ((0x10000000 / (SECTOR_SIZE / 4)) / FAT_MIRROR_GRANULE_SECTORS)
+#define BPB_EXT_FLAGS_NO_MIRROR 0x0080 // Only the FAT in bits 0-3 is active
+
+typedef struct {
+    uint32_t first_sector; // FAT-relative sector of data[0]
+    uint32_t last_used;    // LRU stamp
+    uint8_t  dirty_mask;   // One bit per sector of the block
+    bool     valid;
+    uint8_t  data[FAT_CACHE_BLOCK_SECTORS * SECTOR_SIZE];
+} fat_cache_block_t;
+
+static fat_cache_block_t fat_cache[FAT_CACHE_BLOCKS];
+static uint32_t fat_cache_clock = 0;
+
+static uint32_t fat_mirror_storage[FAT_MIRROR_MAX_GRANULES / 32];
+static Bitmap* fat_mirror_stale = nullptr; // Granules of FAT #1 not yet copied; null = write all FATs
+static bool fat_mirrors_stale = false;     // On-disk ext_flags currently disable mirroring
+
+// Records in the boot sector and its backup whether the FAT mirrors may be out of date.
+static bool fat32_set_mirror_flag(uint64_t ahci_base, int port, bool stale) {
     uint8_t buffer[SECTOR_SIZE];
-    uint64_t lba = cluster_to_lba(current_directory_cluster);
-    char old_target[11], new_target[11];
-    to_83_format(old_name, old_target);
-    to_83_format(new_name, new_target);
-
-    for (uint8_t s = 0; s < fat32_bpb.sec_per_clus; s++) {
-        if (read_sectors(ahci_base, port, lba + s, (uint32_t)1, buffer) != 0) return -1; // Read error
-
-        for (uint16_t e = 0; e < SECTOR_SIZE / ENTRY_SIZE; e++) {
-            fat_dir_entry_t *entry = (fat_dir_entry_t *)(buffer + e * ENTRY_SIZE);
-            if (entry->name[0] == 0x00) return -2; // File not found
-
-            if (entry->name[0] != DELETED_ENTRY && simple_memcmp(entry->name, old_target, 11) == 0) {
-                // Found the file, now rename it
-                simple_memcpy(entry->name, new_target, 11);
-                
-                // Write the modified directory sector back to disk
-                if (write_sectors(ahci_base, port, lba + s, (uint32_t)1, buffer) != 0) {
-                    return -3; // Write error
-                }
-                return 0; // Success
-            }
+    if (read_sectors(ahci_base, port, 0, (uint32_t)1, buffer) != 0) return false;
+    uint16_t flags = stale ? BPB_EXT_FLAGS_NO_MIRROR : 0; // FAT #1 (index 0) active
+    ((fat32_bpb_t*)buffer)->ext_flags = flags;
+    if (write_sectors(ahci_base, port, 0, (uint32_t)1, buffer) != 0) return false;
+    // Keep the backup boot sector's copy in step for recovery tools.
+    uint16_t backup = fat32_bpb.bk_boot_sec;
+    if (backup != 0 && backup < fat32_bpb.rsvd_sec_cnt) {
+        if (read_sectors(ahci_base, port, backup, (uint32_t)1, buffer) != 0) return false;
+        ((fat32_bpb_t*)buffer)->ext_flags = flags;
+        if (write_sectors(ahci_base, port, backup, (uint32_t)1, buffer) != 0) return false;
+    }
+    fat32_bpb.ext_flags = flags;
+    fat_mirrors_stale = stale;
+    return true;
+}
+
+static void fat_cache_invalidate() {
+    for (int i = 0; i < FAT_CACHE_BLOCKS; i++) { fat_cache[i].valid = false; fat_cache[i].dirty_mask = 0; }
+    fat_cache_clock = 0;
+}
+
+static bool fat_cache_write_back(uint64_t ahci_base, int port, fat_cache_block_t* block) {
+    if (!block->valid || block->dirty_mask == 0) return true;
+    uint32_t first = 0, last = FAT_CACHE_BLOCK_SECTORS - 1;
+    while (!(block->dirty_mask & (1 << first))) first++;
+    while (!(block->dirty_mask & (1 << last))) last--;
+    bool defer = fat_mirror_stale && fat32_bpb.num_fats > 1;
+    // The flag must reach the disk before FAT #1 and its mirrors can differ.
+    if (defer && !fat_mirrors_stale && !fat32_set_mirror_flag(ahci_base, port, true)) return false;
+    uint8_t copies = defer ? 1 : fat32_bpb.num_fats;
+    for (uint8_t i = 0; i < copies; i++) {
+        uint64_t lba = fat_start_sector + (i * fat32_bpb.fat_sz32) + block->first_sector + first;
+        if (write_sectors(ahci_base, port, lba, last - first + 1, block->data + first * SECTOR_SIZE) != 0) return false;
+    }
+    if (defer) fat_mirror_stale->set(block->first_sector / FAT_MIRROR_GRANULE_SECTORS);
+    block->dirty_mask = 0;
+    return true;
+}
+
+// Returns a pointer to the cached copy of a FAT sector (relative to the first FAT),
+// loading its block on a miss. Marks the sector dirty when it is about to be modified.
+static uint8_t* fat_cache_get_sector(uint64_t ahci_base, int port, uint32_t fat_sector, bool mark_dirty) {
+    if (fat_sector >= fat32_bpb.fat_sz32) return nullptr;
+    uint32_t block_start = fat_sector - (fat_sector % FAT_CACHE_BLOCK_SECTORS);
+    fat_cache_block_t* block = nullptr;
+    fat_cache_block_t* victim = nullptr;
+    for (int i = 0; i < FAT_CACHE_BLOCKS; i++) {
+        fat_cache_block_t* b = &fat_cache[i];
+        if (b->valid && b->first_sector == block_start) { block = b; break; }
+        if (!victim || (victim->valid && (!b->valid || b->last_used < victim->last_used))) victim = b;
+    }
+    if (!block) {
+        if (!fat_cache_write_back(ahci_base, port, victim)) return nullptr;
+        uint32_t count = fat32_bpb.fat_sz32 - block_start;
+        if (count > FAT_CACHE_BLOCK_SECTORS) count = FAT_CACHE_BLOCK_SECTORS;
+        victim->valid = false;
+        if (read_sectors(ahci_base, port, fat_start_sector + block_start, count, victim->data) != 0) return nullptr;
+        victim->first_sector = block_start;
+        victim->dirty_mask = 0;
+        victim->valid = true;
+        block = victim;
+    }
+    block->last_used = ++fat_cache_clock;
+    uint32_t index = fat_sector - block_start;
+    if (mark_dirty) { block->dirty_mask |= (1 << index); writeback_arm(); }
+    return block->data + index * SECTOR_SIZE;
+}
+
+// Writes every dirty FAT sector back to FAT #1 (all copies if mirrors are not deferred).
+bool fat32_flush_fat(uint64_t ahci_base, int port) {
+    bool ok = true;
+    for (int i = 0; i < FAT_CACHE_BLOCKS; i++) {
+        if (!fat_cache_write_back(ahci_base, port, &fat_cache[i])) ok = false;
+    }
+    return ok;
+}
+
+// --- FREE CLUSTER MAP ---
+// One bit per cluster (1 = in use), built from a single sequential pass over the
+// first FAT at mount and kept current by write_fat_entry(). Volumes with more than
+// FREE_MAP_MAX_CLUSTERS clusters fall back to scanning the (cached) FAT.
+#define FREE_MAP_MAX_CLUSTERS (4 * 1024 * 1024)
+
+static uint32_t free_map_storage[FREE_MAP_MAX_CLUSTERS / 32];
+static Bitmap* free_cluster_map = nullptr; // Wraps free_map_storage; never freed
+static bool free_map_ready = false;
+
+// Bulk transfer buffer for sequential metadata passes (one maximum-size AHCI command).
+static uint8_t fat_scan_buffer[MAX_TRANSFER_SECTORS * SECTOR_SIZE] __attribute__((aligned(4)));
+// Never written: source for zero-filling up to MAX_TRANSFER_SECTORS per command.
+static uint8_t zero_buffer[MAX_TRANSFER_SECTORS * SECTOR_SIZE] __attribute__((aligned(4)));
+
+static bool zero_sectors(uint64_t ahci_base, int port, uint64_t lba, uint32_t count) {
+    while (count > 0) {
+        uint32_t n = (count > MAX_TRANSFER_SECTORS) ? MAX_TRANSFER_SECTORS : count;
+        if (write_sectors(ahci_base, port, lba, n, zero_buffer) != 0) return false;
+        lba += n;
+        count -= n;
+    }
+    return true;
+}
+
+// Clears a region for format: drives that read trimmed sectors back as zeroes get
+// DATA SET MANAGEMENT/TRIM, everything else maximum-size writes of zero_buffer.
+static bool clear_region(uint64_t ahci_base, int port, uint64_t lba, uint32_t count) {
+    if (ata_drive_info.valid && ata_drive_info.trim_reads_zero) {
+        ata_trim_range_t range = { lba, count };
+        if (ata_trim_ranges(ahci_base, port, &range, 1) == 0) return true;
+    }
+    return zero_sectors(ahci_base, port, lba, count);
+}
+
+// Flushes the FAT cache, then copies each stale granule of FAT #1 to every other FAT with
+// one read and one write per copy, and finally turns mirroring back on in the BPB.
+bool fat32_sync_fat_mirrors(uint64_t ahci_base, int port) {
+    if (!fat32_flush_fat(ahci_base, port)) return false;
+    if (!fat_mirrors_stale) return true;
+    uint32_t granules = (fat32_bpb.fat_sz32 + FAT_MIRROR_GRANULE_SECTORS - 1) / FAT_MIRROR_GRANULE_SECTORS;
+    for (uint32_t g = 0; g < granules; g++) {
+        if (fat_mirror_stale->word(g / 32) == 0) { g |= 31; continue; } // Skip 32 clean granules
+        if (!fat_mirror_stale->test(g)) continue;
+        uint32_t first = g * FAT_MIRROR_GRANULE_SECTORS;
+        uint32_t count = fat32_bpb.fat_sz32 - first;
+        if (count > FAT_MIRROR_GRANULE_SECTORS) count = FAT_MIRROR_GRANULE_SECTORS;
+        if (read_sectors(ahci_base, port, fat_start_sector + first, count, fat_scan_buffer) != 0) return false;
+        for (uint8_t i = 1; i < fat32_bpb.num_fats; i++) {
+            if (write_sectors(ahci_base, port, fat_start_sector + i * fat32_bpb.fat_sz32 + first, count, fat_scan_buffer) != 0) return false;
         }
+        fat_mirror_stale->clear(g);
     }
-    return -2; // File not found
+    return fat32_set_mirror_flag(ahci_base, port, false);
 }
 
-// Copies a file by reading it into memory and creating a new file with its contents.
-int fat32_copy_file(uint64_t ahci_base, int port, const char* src_name, const char* dest_name) {
-    uint8_t dir_sector_buffer[SECTOR_SIZE];
-    uint64_t lba = cluster_to_lba(current_directory_cluster);
-    char src_target[11];
-    to_83_format(src_name, src_target);
-    
-    // 1. Find the source file to get its size
-    uint32_t file_size = 0;
-    bool found = false;
-    for (uint8_t s = 0; s < fat32_bpb.sec_per_clus; s++) {
-        if (read_sectors(ahci_base, port, lba + s, (uint32_t)1, dir_sector_buffer) != 0) return -1;
-        for (uint16_t e = 0; e < SECTOR_SIZE / ENTRY_SIZE; e++) {
-            fat_dir_entry_t* entry = (fat_dir_entry_t*)(dir_sector_buffer + e * ENTRY_SIZE);
-            if (entry->name[0] == 0) break;
-            if (entry->name[0] != DELETED_ENTRY && simple_memcmp(entry->name, src_target, 11) == 0) {
-                file_size = entry->file_size;
-                found = true;
-                break;
-            }
+static bool build_free_cluster_map(uint64_t ahci_base, int port, uint32_t* free_count) {
+    free_map_ready = false;
+    uint32_t free_clusters = 0;
+    uint32_t max_clusters = fat32_max_clusters();
+    if (max_clusters > FREE_MAP_MAX_CLUSTERS || max_clusters > fat32_bpb.fat_sz32 * (SECTOR_SIZE / 4)) return false;
+    if (!free_cluster_map) free_cluster_map = new Bitmap();
+    if (!free_cluster_map) return false;
+    free_cluster_map->attach(free_map_storage, max_clusters);
+
+    const uint32_t entries_per_read = sizeof(fat_scan_buffer) / 4;
+    for (uint32_t base = 0; base < max_clusters; base += entries_per_read) {
+        uint32_t entries = max_clusters - base;
+        if (entries > entries_per_read) entries = entries_per_read;
+        uint32_t sectors = (entries * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (read_sectors(ahci_base, port, fat_start_sector + base / (SECTOR_SIZE / 4), sectors, fat_scan_buffer) != 0) return false;
+        const uint32_t* fat = (const uint32_t*)fat_scan_buffer;
+        for (uint32_t i = 0; i < entries; i++) {
+            if ((fat[i] & 0x0FFFFFFF) != FAT_FREE_CLUSTER || base + i < 2) free_cluster_map->set(base + i);
+            else free_clusters++;
         }
-        if (found) break;
     }
+    *free_count = free_clusters;
+    free_map_ready = true;
+    return true;
+}
+
+// --- DEFERRED TRIM ---
+// Clusters freed through write_fat_entry() are collected as runs and trimmed in batches by
+// fat32_trim_pending() at sync points, once the FAT that frees them is on disk. Each run is
+// checked against the live FAT first, so clusters reallocated in the meantime are skipped.
+// Frees that do not fit the pending list are dropped; 'fstrim' picks them up later.
+#define TRIM_MAX_PENDING 512
+#define TRIM_BATCH_RANGES 64
+
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} trim_extent_t;
+
+static trim_extent_t trim_pending[TRIM_MAX_PENDING];
+static uint32_t trim_pending_count = 0;
+static ata_trim_range_t trim_batch[TRIM_BATCH_RANGES];
+static int trim_batch_count = 0;
+static bool trim_batch_failed = false;
+
+static inline bool trim_supported() {
+    return ata_drive_info.valid && ata_drive_info.trim;
+}
 
-    if (!found) return -2; // Source file not found
-    if (file_size == 0) { // Handle empty file case
-        return fat32_add_file(ahci_base, port, dest_name, "", 0);
+static void trim_note_free(uint32_t cluster) {
+    if (!trim_supported()) return;
+    if (trim_pending_count > 0) {
+        trim_extent_t* last = &trim_pending[trim_pending_count - 1];
+        if (last->first + last->count == cluster) { last->count++; return; }
+        if (cluster + 1 == last->first) { last->first--; last->count++; return; }
     }
+    if (trim_pending_count < TRIM_MAX_PENDING) {
+        trim_pending[trim_pending_count].first = cluster;
+        trim_pending[trim_pending_count].count = 1;
+        trim_pending_count++;
+    }
+}
 
-    // 2. Allocate memory and read the source file into the buffer
-    char* file_buffer = new char[file_size];
-    if (!file_buffer) return -4; // Memory allocation failed
+static void trim_batch_send(uint64_t ahci_base, int port) {
+    if (trim_batch_count > 0 && ata_trim_ranges(ahci_base, port, trim_batch, trim_batch_count) != 0) trim_batch_failed = true;
+    trim_batch_count = 0;
+}
 
-    int bytes_read = fat32_read_file_to_buffer(ahci_base, port, src_name, file_buffer, file_size + 1);
-    if (bytes_read < 0) {
-        delete[] file_buffer;
-        return -1; // Read error
+// Queues 'count' clusters from 'first' for the next DSM command, merging with the last
+// range when they touch.
+static void trim_batch_add(uint64_t ahci_base, int port, uint32_t first, uint32_t count) {
+    uint64_t lba = cluster_to_lba(first);
+    uint32_t sectors = count * fat32_bpb.sec_per_clus;
+    if (trim_batch_count > 0) {
+        ata_trim_range_t* last = &trim_batch[trim_batch_count - 1];
+        if (last->lba + last->count == lba && last->count <= 0xFFFFFFFFu - sectors) { last->count += sectors; return; }
     }
+    if (trim_batch_count == TRIM_BATCH_RANGES) trim_batch_send(ahci_base, port);
+    trim_batch[trim_batch_count].lba = lba;
+    trim_batch[trim_batch_count].count = sectors;
+    trim_batch_count++;
+}
 
-    // 3. Write the buffer to the destination file
-    int result = fat32_add_file(ahci_base, port, dest_name, file_buffer, file_size);
-    
-    // 4. Clean up and return
-    delete[] file_buffer;
-    return result;
+static inline bool trim_cluster_is_free(uint64_t ahci_base, int port, uint32_t cluster) {
+    if (free_map_ready) return !free_cluster_map->test(cluster);
+    return read_fat_entry(ahci_base, port, cluster) == FAT_FREE_CLUSTER;
+}
+
+// Trims the still-free parts of 'count' clusters from 'first'. Returns clusters trimmed.
+static uint32_t trim_free_clusters(uint64_t ahci_base, int port, uint32_t first, uint32_t count) {
+    uint32_t end = first + count, trimmed = 0;
+    uint32_t max_clusters = fat32_max_clusters();
+    if (end > max_clusters) end = max_clusters;
+    uint32_t cluster = (first < 2) ? 2 : first;
+    while (cluster < end) {
+        while (cluster < end && !trim_cluster_is_free(ahci_base, port, cluster)) cluster++;
+        uint32_t run_start = cluster;
+        while (cluster < end && trim_cluster_is_free(ahci_base, port, cluster)) cluster++;
+        if (cluster > run_start) {
+            trim_batch_add(ahci_base, port, run_start, cluster - run_start);
+            trimmed += cluster - run_start;
+        }
+    }
+    return trimmed;
+}
+
+// Sends TRIM for every cluster freed since the last call. Run after the FAT is written.
+bool fat32_trim_pending(uint64_t ahci_base, int port) {
+    if (trim_pending_count == 0) return true;
+    trim_batch_count = 0;
+    trim_batch_failed = false;
+    if (trim_supported()) {
+        for (uint32_t i = 0; i < trim_pending_count; i++) trim_free_clusters(ahci_base, port, trim_pending[i].first, trim_pending[i].count);
+        trim_batch_send(ahci_base, port);
+    }
+    trim_pending_count = 0;
+    return !trim_batch_failed;
+}
+
+// --- FSINFO ---
+// Free cluster count and next-free hint are loaded from the FSInfo sector at mount,
+// updated in memory by write_fat_entry()/allocate_cluster(), and written back at unmount.
+#define FSINFO_LEAD_SIG  0x41615252
+#define FSINFO_STRUC_SIG 0x61417272
+#define FSINFO_TRAIL_SIG 0xAA550000
+#define FSINFO_UNKNOWN   0xFFFFFFFF
+
+static uint32_t free_cluster_count = FSINFO_UNKNOWN;
+static bool fsinfo_dirty = false;
+
+// Reads the FSInfo sector into buffer and checks its signatures.
+static bool fat32_read_fsinfo_sector(uint64_t ahci_base, int port, uint8_t* buffer) {
+    if (fat32_bpb.fs_info == 0 || fat32_bpb.fs_info >= fat32_bpb.rsvd_sec_cnt) return false;
+    if (read_sectors(ahci_base, port, fat32_bpb.fs_info, (uint32_t)1, buffer) != 0) return false;
+    return *(uint32_t*)(buffer + 0) == FSINFO_LEAD_SIG && *(uint32_t*)(buffer + 484) == FSINFO_STRUC_SIG &&
+           *(uint32_t*)(buffer + 508) == FSINFO_TRAIL_SIG;
 }
 
+static bool fat32_load_fsinfo(uint64_t ahci_base, int port, uint32_t* free_count, uint32_t* next_free) {
+    uint8_t buffer[SECTOR_SIZE];
+    if (!fat32_read_fsinfo_sector(ahci_base, port, buffer)) return false;
+    *free_count = *(uint32_t*)(buffer + 488);
+    *next_free = *(uint32_t*)(buffer + 492);
+    return true;
+}
 
+// Writes the in-memory free count and next-free hint back to the FSInfo sector.
+bool fat32_write_fsinfo(uint64_t ahci_base, int port) {
+    if (!fsinfo_dirty) return true;
+    uint8_t buffer[SECTOR_SIZE];
+    if (!fat32_read_fsinfo_sector(ahci_base, port, buffer)) return false;
+    *(uint32_t*)(buffer + 488) = free_cluster_count;
+    *(uint32_t*)(buffer + 492) = next_free_cluster;
+    if (write_sectors(ahci_base, port, fat32_bpb.fs_info, (uint32_t)1, buffer) != 0) return false;
+    fsinfo_dirty = false;
+    return true;
+}
 
 bool fat32_init(uint64_t ahci_base, int port) {
     uint8_t buffer[SECTOR_SIZE];
     if (read_sectors(ahci_base, port, 0, (uint32_t)1, buffer) != 0) return false;
+    exfat_mounted = false;
+    if (simple_memcmp(buffer + 3, "EXFAT   ", 8) == 0) return exfat_mount(ahci_base, port, buffer);
     simple_memcpy(&fat32_bpb, buffer, sizeof(fat32_bpb_t));
     if (simple_memcmp(fat32_bpb.fil_sys_type, "FAT32   ", 8) != 0) return false;
+    fat_cache_invalidate();
+    dir_index_invalidate();
+    dentry_clear();
+    dir_buffer_cluster = 0;
+    fat32_close_all_files();
+    trim_pending_count = 0;
+    if (!ata_drive_info.valid) ata_identify(ahci_base, port); // TRIM support
     fat_start_sector = fat32_bpb.rsvd_sec_cnt;
     data_start_sector = fat_start_sector + (fat32_bpb.num_fats * fat32_bpb.fat_sz32);
     current_directory_cluster = fat32_bpb.root_clus;
+    current_path[0] = '/';
+    current_path[1] = '\0';
+
+    // Mirror writes are deferred when the granule map fits. A volume left with mirroring
+    // off (we never make another FAT active) gets every mirror rebuilt at the next sync.
+    uint32_t granules = (fat32_bpb.fat_sz32 + FAT_MIRROR_GRANULE_SECTORS - 1) / FAT_MIRROR_GRANULE_SECTORS;
+    fat_mirrors_stale = false;
+    if (fat32_bpb.num_fats > 1 && granules <= FAT_MIRROR_MAX_GRANULES) {
+        if (!fat_mirror_stale) fat_mirror_stale = new Bitmap();
+        if (fat_mirror_stale) {
+            fat_mirror_stale->attach(fat_mirror_storage, granules);
+            if (fat32_bpb.ext_flags & BPB_EXT_FLAGS_NO_MIRROR) {
+                for (uint32_t g = 0; g < granules; g++) fat_mirror_stale->set(g);
+                fat_mirrors_stale = true;
+            }
+        }
+    }
+
+    uint32_t max_clusters = fat32_max_clusters();
+    uint32_t fsi_free = FSINFO_UNKNOWN, fsi_next = FSINFO_UNKNOWN, map_free = 0;
+    bool have_fsinfo = fat32_load_fsinfo(ahci_base, port, &fsi_free, &fsi_next);
+    if (!have_fsinfo || fsi_free > max_clusters - 2) fsi_free = FSINFO_UNKNOWN;
+    next_free_cluster = (have_fsinfo && fsi_next >= 2 && fsi_next < max_clusters) ? fsi_next : 3;
+    free_cluster_count = fsi_free;
+    fsinfo_dirty = false;
+
+    if (build_free_cluster_map(ahci_base, port, &map_free)) {
+        // The map is exact; correct a stale FSInfo count at the next write-back.
+        if (map_free != fsi_free) { fsinfo_dirty = true; writeback_arm(); }
+        free_cluster_count = map_free;
+    } else {
+        cout << "Note: free cluster map unavailable, allocation will scan the FAT.\n";
+    }
     return true;
 }
 
 uint32_t read_fat_entry(uint64_t ahci_base, int port, uint32_t cluster) {
     if (cluster < 2) return FAT_BAD_CLUSTER;
     uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fat_start_sector + (fat_offset / SECTOR_SIZE);
-    uint32_t entry_offset = fat_offset % SECTOR_SIZE;
-    uint8_t buffer[SECTOR_SIZE];
-    if (read_sectors(ahci_base, port, fat_sector, (uint32_t)1, buffer) != 0) return FAT_BAD_CLUSTER;
-    return (*(uint32_t*)(buffer + entry_offset)) & 0x0FFFFFFF;
+    uint8_t* sector = fat_cache_get_sector(ahci_base, port, fat_offset / SECTOR_SIZE, false);
+    if (!sector) return FAT_BAD_CLUSTER;
+    return (*(uint32_t*)(sector + (fat_offset % SECTOR_SIZE))) & 0x0FFFFFFF;
 }
 
 bool write_fat_entry(uint64_t ahci_base, int port, uint32_t cluster, uint32_t value) {
     if (cluster < 2) return false;
     uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector_offset = fat_offset / SECTOR_SIZE;
-    uint32_t entry_offset = fat_offset % SECTOR_SIZE;
-    uint8_t buffer[SECTOR_SIZE];
-    if (read_sectors(ahci_base, port, fat_start_sector + fat_sector_offset, (uint32_t)1, buffer) != 0) return false;
-    uint32_t* fat_entry_ptr = (uint32_t*)(buffer + entry_offset);
+    uint8_t* sector = fat_cache_get_sector(ahci_base, port, fat_offset / SECTOR_SIZE, true);
+    if (!sector) return false;
+    uint32_t* fat_entry_ptr = (uint32_t*)(sector + (fat_offset % SECTOR_SIZE));
+    bool was_free = (*fat_entry_ptr & 0x0FFFFFFF) == FAT_FREE_CLUSTER;
+    bool now_free = (value & 0x0FFFFFFF) == FAT_FREE_CLUSTER;
     *fat_entry_ptr = (*fat_entry_ptr & 0xF0000000) | (value & 0x0FFFFFFF);
-    for (uint8_t i = 0; i < fat32_bpb.num_fats; i++) {
-        uint32_t current_fat_sector = fat_start_sector + (i * fat32_bpb.fat_sz32) + fat_sector_offset;
-        if (write_sectors(ahci_base, port, current_fat_sector, (uint32_t)1, buffer) != 0) return false;
+    if (was_free != now_free) {
+        if (now_free && cluster == dir_buffer_cluster) dir_buffer_cluster = 0;
+        if (now_free) trim_note_free(cluster);
+        if (free_map_ready) {
+            if (now_free) free_cluster_map->clear(cluster);
+            else free_cluster_map->set(cluster);
+        }
+        if (free_cluster_count != FSINFO_UNKNOWN) {
+            if (now_free) free_cluster_count++;
+            else free_cluster_count--;
+        }
+        fsinfo_dirty = true;
     }
     return true;
 }
 
 uint32_t find_free_cluster(uint64_t ahci_base, int port, uint32_t start_cluster) {
-    uint32_t max_clusters = (fat32_bpb.tot_sec32 - data_start_sector) / fat32_bpb.sec_per_clus + 2;
+    uint32_t max_clusters = fat32_max_clusters();
+    if (start_cluster < 2 || start_cluster >= max_clusters) start_cluster = 2;
+    if (free_map_ready) {
+        size_t cluster = free_cluster_map->find_first_clear(start_cluster);
+        if (cluster >= max_clusters && start_cluster > 2) cluster = free_cluster_map->find_first_clear(2);
+        return (cluster < max_clusters) ? (uint32_t)cluster : 0;
+    }
     for (uint32_t cluster = start_cluster; cluster < max_clusters; cluster++) {
         if (read_fat_entry(ahci_base, port, cluster) == FAT_FREE_CLUSTER) return cluster;
     }
@@ -417,15 +1344,11 @@ uint32_t find_free_cluster(uint64_t ahci_base, int port, uint32_t start_cluster)
 }
 
 uint32_t allocate_cluster(uint64_t ahci_base, int port) {
+    if (free_cluster_count == 0) { cout << "Disk full\n"; return 0; }
     uint32_t cluster = find_free_cluster(ahci_base, port, next_free_cluster);
     if (cluster == 0) { cout << "Disk full\n"; return 0; }
     if (!write_fat_entry(ahci_base, port, cluster, FAT_END_OF_CHAIN)) { cout << "Failed to update FAT\n"; return 0; }
-    uint8_t zero_buffer[SECTOR_SIZE];
-    simple_memset(zero_buffer, 0, SECTOR_SIZE);
-    uint64_t cluster_lba = cluster_to_lba(cluster);
-    for (uint8_t s = 0; s < fat32_bpb.sec_per_clus; s++) {
-        if (write_sectors(ahci_base, port, cluster_lba + s, (uint32_t)1, zero_buffer) != 0) { cout << "Failed to clear cluster\n"; }
-    }
+    if (!zero_sectors(ahci_base, port, cluster_to_lba(cluster), fat32_bpb.sec_per_clus)) { cout << "Failed to clear cluster\n"; }
     next_free_cluster = cluster + 1;
     return cluster;
 }
@@ -440,98 +1363,1649 @@ void free_cluster_chain(uint64_t ahci_base, int port, uint32_t start_cluster) {
     }
 }
 
+// Finds free clusters for an allocation of 'wanted' clusters: the first run at or after
+// the allocation hint that is long enough, otherwise the longest run on the volume.
+// Returns the run's first cluster (0 if the volume is full) and its usable length.
+static uint32_t find_free_run(uint64_t ahci_base, int port, uint32_t wanted, uint32_t* run_length) {
+    uint32_t max_clusters = fat32_max_clusters();
+    uint32_t hint = (next_free_cluster >= 2 && next_free_cluster < max_clusters) ? next_free_cluster : 2;
+    *run_length = 0;
+    if (!free_map_ready) {
+        uint32_t cluster = find_free_cluster(ahci_base, port, hint);
+        if (cluster == 0) return 0;
+        uint32_t length = 1;
+        while (length < wanted && cluster + length < max_clusters &&
+               read_fat_entry(ahci_base, port, cluster + length) == FAT_FREE_CLUSTER) length++;
+        *run_length = length;
+        return cluster;
+    }
+    uint32_t best_start = 0, best_length = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t pos = (pass == 0) ? hint : 2;
+        size_t end = (pass == 0) ? max_clusters : hint;
+        while (pos < end) {
+            pos = free_cluster_map->find_first_clear(pos);
+            if (pos >= end) break;
+            uint32_t length = free_cluster_map->clear_run_length(pos, wanted);
+            if (length >= wanted) { *run_length = wanted; return pos; }
+            if (length > best_length) { best_start = pos; best_length = length; }
+            pos += length;
+        }
+    }
+    *run_length = best_length;
+    return best_start;
+}
+
+// Marks 'length' clusters from 'start' as a linked, EOC-terminated chain. The entries
+// land in the FAT cache, so a whole run costs a few sector writes at flush time.
+static bool link_cluster_run(uint64_t ahci_base, int port, uint32_t start, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        uint32_t value = (i + 1 < length) ? start + i + 1 : FAT_END_OF_CHAIN;
+        if (!write_fat_entry(ahci_base, port, start + i, value)) {
+            while (i-- > 0) write_fat_entry(ahci_base, port, start + i, FAT_FREE_CLUSTER);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Allocates a chain of num_clusters built from as few contiguous runs as possible.
+// The clusters are NOT zeroed; callers are expected to overwrite them with file data.
 uint32_t allocate_cluster_chain(uint64_t ahci_base, int port, uint32_t num_clusters) {
     if (num_clusters == 0) return 0;
-    uint32_t first_cluster = allocate_cluster(ahci_base, port);
-    if (first_cluster == 0) return 0;
-    uint32_t current_cluster = first_cluster;
-    for (uint32_t i = 1; i < num_clusters; i++) {
-        uint32_t next_cluster = allocate_cluster(ahci_base, port);
-        if (next_cluster == 0) { free_cluster_chain(ahci_base, port, first_cluster); return 0; }
-        if (!write_fat_entry(ahci_base, port, current_cluster, next_cluster)) { free_cluster_chain(ahci_base, port, first_cluster); return 0; }
-        current_cluster = next_cluster;
+    if (free_cluster_count != FSINFO_UNKNOWN && free_cluster_count < num_clusters) { cout << "Disk full\n"; return 0; }
+    uint32_t first_cluster = 0, tail_cluster = 0, remaining = num_clusters;
+    while (remaining > 0) {
+        uint32_t run_length = 0;
+        uint32_t run_start = find_free_run(ahci_base, port, remaining, &run_length);
+        if (run_start == 0) { cout << "Disk full\n"; break; }
+        if (!link_cluster_run(ahci_base, port, run_start, run_length)) { cout << "Failed to update FAT\n"; break; }
+        if (tail_cluster && !write_fat_entry(ahci_base, port, tail_cluster, run_start)) {
+            free_cluster_chain(ahci_base, port, run_start);
+            cout << "Failed to update FAT\n";
+            break;
+        }
+        if (!first_cluster) first_cluster = run_start;
+        tail_cluster = run_start + run_length - 1;
+        next_free_cluster = tail_cluster + 1;
+        remaining -= run_length;
+    }
+    if (remaining > 0) {
+        if (first_cluster) free_cluster_chain(ahci_base, port, first_cluster);
+        return 0;
     }
     return first_cluster;
 }
 
-bool read_data_from_clusters(uint64_t ahci_base, int port, uint32_t start_cluster, void* data, uint32_t size) {
-    uint8_t* data_ptr = (uint8_t*)data;
-    uint32_t remaining = size;
-    uint32_t current_cluster = start_cluster;
-    uint32_t cluster_size = fat32_bpb.sec_per_clus * SECTOR_SIZE;
-    while (current_cluster >= 2 && current_cluster < FAT_BAD_CLUSTER && remaining > 0) {
-        uint64_t lba = cluster_to_lba(current_cluster);
-        uint32_t to_read = (remaining > cluster_size) ? cluster_size : remaining;
-        uint32_t full_sectors = to_read / SECTOR_SIZE;
-        if (full_sectors > 0) {
-            if (read_sectors(ahci_base, port, lba, full_sectors, data_ptr) != 0) return false;
-            data_ptr += full_sectors * SECTOR_SIZE;
-            remaining -= full_sectors * SECTOR_SIZE;
-        }
-        uint32_t partial_bytes = to_read % SECTOR_SIZE;
-        if (partial_bytes > 0) {
-            uint8_t sector_buffer[SECTOR_SIZE];
-            if (read_sectors(ahci_base, port, lba + full_sectors, (uint32_t)1, sector_buffer) != 0) return false;
-            simple_memcpy(data_ptr, sector_buffer, partial_bytes);
-            remaining -= partial_bytes;
-        }
-        current_cluster = read_fat_entry(ahci_base, port, current_cluster);
+// Reads 'bytes' from consecutive sectors at 'lba' straight into dest using maximum-size
+// commands; only a trailing partial sector goes through a bounce buffer.
+static bool read_contiguous(uint64_t ahci_base, int port, uint64_t lba, uint8_t* dest, uint32_t bytes) {
+    uint32_t full_sectors = bytes / SECTOR_SIZE;
+    while (full_sectors > 0) {
+        uint32_t n = (full_sectors > MAX_TRANSFER_SECTORS) ? MAX_TRANSFER_SECTORS : full_sectors;
+        if (read_sectors(ahci_base, port, lba, n, dest) != 0) return false;
+        lba += n;
+        dest += n * SECTOR_SIZE;
+        full_sectors -= n;
+    }
+    uint32_t partial_bytes = bytes % SECTOR_SIZE;
+    if (partial_bytes > 0) {
+        uint8_t sector_buffer[SECTOR_SIZE];
+        if (read_sectors(ahci_base, port, lba, (uint32_t)1, sector_buffer) != 0) return false;
+        simple_memcpy(dest, sector_buffer, partial_bytes);
+    }
+    return true;
+}
+
+// Returns the last cluster of the physically contiguous run starting at 'cluster',
+// stopping once the run covers 'wanted_bytes'. *next receives the FAT link out of the run.
+static uint32_t contiguous_run_end(uint64_t ahci_base, int port, uint32_t cluster, uint32_t wanted_bytes, uint32_t* next) {
+    uint32_t cluster_size = fat32_bpb.sec_per_clus * SECTOR_SIZE;
+    uint32_t last = cluster;
+    uint32_t link = read_fat_entry(ahci_base, port, last);
+    while (link == last + 1 && (uint64_t)(last - cluster + 1) * cluster_size < wanted_bytes) {
+        last = link;
+        link = read_fat_entry(ahci_base, port, last);
+    }
+    *next = link;
+    return last;
+}
+
+bool read_data_from_clusters(uint64_t ahci_base, int port, uint32_t start_cluster, void* data, uint32_t size) {
+    uint8_t* data_ptr = (uint8_t*)data;
+    uint32_t remaining = size;
+    uint32_t current_cluster = start_cluster;
+    uint32_t cluster_size = fat32_bpb.sec_per_clus * SECTOR_SIZE;
+    while (current_cluster >= 2 && current_cluster < FAT_BAD_CLUSTER && remaining > 0) {
+        uint32_t next_cluster;
+        uint32_t last_cluster = contiguous_run_end(ahci_base, port, current_cluster, remaining, &next_cluster);
+        uint64_t run_bytes = (uint64_t)(last_cluster - current_cluster + 1) * cluster_size;
+        uint32_t to_read = (run_bytes < remaining) ? (uint32_t)run_bytes : remaining;
+        if (!read_contiguous(ahci_base, port, cluster_to_lba(current_cluster), data_ptr, to_read)) return false;
+        data_ptr += to_read;
+        remaining -= to_read;
+        current_cluster = next_cluster;
     }
     return remaining == 0;
 }
 
+// Writes 'bytes' from src to consecutive sectors at 'lba' using maximum-size commands.
+// A trailing partial sector is zero-padded through a bounce buffer.
+static bool write_contiguous(uint64_t ahci_base, int port, uint64_t lba, const uint8_t* src, uint32_t bytes) {
+    uint32_t full_sectors = bytes / SECTOR_SIZE;
+    while (full_sectors > 0) {
+        uint32_t n = (full_sectors > MAX_TRANSFER_SECTORS) ? MAX_TRANSFER_SECTORS : full_sectors;
+        if (write_sectors(ahci_base, port, lba, n, (void*)src) != 0) return false;
+        lba += n;
+        src += n * SECTOR_SIZE;
+        full_sectors -= n;
+    }
+    uint32_t partial_bytes = bytes % SECTOR_SIZE;
+    if (partial_bytes > 0) {
+        uint8_t sector_buffer[SECTOR_SIZE];
+        simple_memset(sector_buffer, 0, SECTOR_SIZE);
+        simple_memcpy(sector_buffer, src, partial_bytes);
+        if (write_sectors(ahci_base, port, lba, (uint32_t)1, sector_buffer) != 0) return false;
+    }
+    return true;
+}
+
 bool write_data_to_clusters(uint64_t ahci_base, int port, uint32_t start_cluster, const void* data, uint32_t size) {
     const uint8_t* data_ptr = (const uint8_t*)data;
     uint32_t remaining = size;
     uint32_t current_cluster = start_cluster;
     uint32_t cluster_size = fat32_bpb.sec_per_clus * SECTOR_SIZE;
     while (current_cluster >= 2 && current_cluster < FAT_BAD_CLUSTER && remaining > 0) {
-        uint64_t lba = cluster_to_lba(current_cluster);
-        uint32_t to_write = (remaining > cluster_size) ? cluster_size : remaining;
-        uint32_t full_sectors = to_write / SECTOR_SIZE;
-        if (full_sectors > 0) {
-            if (write_sectors(ahci_base, port, lba, full_sectors, (void*)data_ptr) != 0) return false;
-            data_ptr += full_sectors * SECTOR_SIZE;
-            remaining -= full_sectors * SECTOR_SIZE;
-        }
-        uint32_t partial_bytes = to_write % SECTOR_SIZE;
-        if (partial_bytes > 0) {
-            uint8_t sector_buffer[SECTOR_SIZE];
-            simple_memset(sector_buffer, 0, SECTOR_SIZE);
-            simple_memcpy(sector_buffer, data_ptr, partial_bytes);
-            if (write_sectors(ahci_base, port, lba + full_sectors, (uint32_t)1, sector_buffer) != 0) return false;
-            remaining -= partial_bytes;
-        }
-        current_cluster = read_fat_entry(ahci_base, port, current_cluster);
+        uint32_t next_cluster;
+        uint32_t last_cluster = contiguous_run_end(ahci_base, port, current_cluster, remaining, &next_cluster);
+        uint64_t run_bytes = (uint64_t)(last_cluster - current_cluster + 1) * cluster_size;
+        uint32_t to_write = (run_bytes < remaining) ? (uint32_t)run_bytes : remaining;
+        if (!write_contiguous(ahci_base, port, cluster_to_lba(current_cluster), data_ptr, to_write)) return false;
+        data_ptr += to_write;
+        remaining -= to_write;
+        current_cluster = next_cluster;
     }
     return remaining == 0;
 }
 
+// --- CHKDSK ---
+// Phase 1 walks the directory tree from an explicit work stack and follows every chain
+// through the FAT cache, marking clusters in a reached map, so cross-links, loops and
+// broken chains are found during the same walk. A second bit per cluster marks every
+// cluster that two chains share; the report counts them and lists each file or directory
+// whose chain includes one. Phase 2 streams the first FAT in maximum-size reads, builds
+// the in-use bits of each 32 entries and compares them with the reached map a word at a
+// time. Orphans are freed in the streamed copy and each changed block is written back to
+// every FAT copy with one command apiece.
+#define CHKDSK_MAX_PENDING_DIRS 4096
+
+static uint32_t chkdsk_reach_storage[FREE_MAP_MAX_CLUSTERS / 32];
+static uint32_t chkdsk_shared_storage[FREE_MAP_MAX_CLUSTERS / 32];
+static uint32_t chkdsk_dir_stack[CHKDSK_MAX_PENDING_DIRS];
+
+typedef struct {
+    Bitmap* reached;          // Cluster belongs to some file or directory
+    Bitmap* shared;           // Cluster belongs to more than one chain (cross-link)
+    uint32_t max_clusters;
+    uint32_t files, directories;
+    uint32_t shared_clusters; // Distinct clusters set in 'shared'
+    uint32_t cross_links, loops, broken_chains, size_mismatches;
+    uint32_t pending;         // Directories on chkdsk_dir_stack
+    bool incomplete;          // Part of the tree could not be walked; do not reclaim
+} chkdsk_state_t;
+
+typedef struct {
+    int reclaimed;            // Clusters freed, or -1 on I/O error
+    uint32_t lost_chains;
+} chkdsk_reclaim_t;
+
+// Returns true if 'target' is one of the first 'steps' clusters of the chain at 'head'.
+// Only used once a walk runs into a marked cluster, to tell a loop from a cross-link.
+static bool chkdsk_chain_contains(uint64_t ahci_base, int port, uint32_t head, uint32_t target, uint32_t steps) {
+    for (uint32_t cluster = head; steps > 0; steps--) {
+        if (cluster == target) return true;
+        cluster = read_fat_entry(ahci_base, port, cluster);
+    }
+    return false;
+}
+
+// Marks the tail of a chain from 'cluster' on as shared after another chain joined it.
+// A tail already marked was shared earlier, and so is everything after it.
+static void chkdsk_mark_shared(uint64_t ahci_base, int port, chkdsk_state_t* st, uint32_t cluster) {
+    for (uint32_t steps = 0; cluster >= 2 && cluster < st->max_clusters && steps < st->max_clusters; steps++) {
+        if (st->shared->test(cluster)) return;
+        st->shared->set(cluster);
+        st->shared_clusters++;
+        cluster = read_fat_entry(ahci_base, port, cluster);
+    }
+}
+
+// Ends a chain at 'last' after a bad link; with no previous cluster the entry is left as is.
+static void chkdsk_terminate(uint64_t ahci_base, int port, uint32_t last) {
+    if (last != 0) write_fat_entry(ahci_base, port, last, FAT_END_OF_CHAIN);
+}
+
+// Walks and marks the chain at 'head', repairing loops and links to free or invalid
+// clusters by ending the chain early. Returns the number of clusters newly marked and
+// sets *complete if the walk reached the end of the chain without joining another one.
+static uint32_t chkdsk_walk_chain(uint64_t ahci_base, int port, chkdsk_state_t* st, uint32_t head, bool* complete) {
+    uint32_t prev = 0, cluster = head, steps = 0;
+    *complete = false;
+    while (true) {
+        if (cluster > FAT_BAD_CLUSTER) { *complete = true; return steps; } // End of chain
+        if (cluster < 2 || cluster >= st->max_clusters || cluster == FAT_BAD_CLUSTER) {
+            cout << "Invalid link in chain at cluster " << head << ". Truncating.\n";
+            st->broken_chains++;
+            chkdsk_terminate(ahci_base, port, prev);
+            return steps;
+        }
+        if (st->reached->test(cluster)) {
+            if (chkdsk_chain_contains(ahci_base, port, head, cluster, steps)) {
+                cout << "Loop in chain at cluster " << head << ". Breaking it.\n";
+                st->loops++;
+                chkdsk_terminate(ahci_base, port, prev);
+            } else {
+                cout << "Cross-linked cluster " << cluster << " (chain at " << head << ").\n";
+                st->cross_links++;
+                chkdsk_mark_shared(ahci_base, port, st, cluster);
+            }
+            return steps;
+        }
+        uint32_t next = read_fat_entry(ahci_base, port, cluster);
+        if (next == FAT_FREE_CLUSTER) {
+            cout << "Chain at cluster " << head << " runs into a free cluster. Truncating.\n";
+            st->broken_chains++;
+            chkdsk_terminate(ahci_base, port, prev);
+            return steps;
+        }
+        st->reached->set(cluster);
+        steps++;
+        prev = cluster;
+        cluster = next;
+    }
+}
+
+static void chkdsk_push_dir(chkdsk_state_t* st, uint32_t cluster) {
+    if (st->pending < CHKDSK_MAX_PENDING_DIRS) chkdsk_dir_stack[st->pending++] = cluster;
+    else st->incomplete = true;
+}
+
+// Phase 1: depth-first walk of the directory tree without recursion.
+// Accounts for one live entry of a directory being scanned.
+static void chkdsk_check_entry(uint64_t ahci_base, int port, chkdsk_state_t* st, const fat_dir_entry_t* entry) {
+    if (entry->name[0] == '.') return;
+    uint32_t first_cluster = (entry->fst_clus_hi << 16) | entry->fst_clus_lo;
+    if (entry->attr & ATTR_DIRECTORY) {
+        chkdsk_push_dir(st, first_cluster);
+        return;
+    }
+    st->files++;
+    if (first_cluster == 0) {
+        if (entry->file_size != 0) st->size_mismatches++;
+        return;
+    }
+    bool complete;
+    uint32_t length = chkdsk_walk_chain(ahci_base, port, st, first_cluster, &complete);
+    if (complete && length != clusters_needed(entry->file_size)) st->size_mismatches++;
+}
+
+static void chkdsk_scan_tree(uint64_t ahci_base, int port, chkdsk_state_t* st) {
+    chkdsk_push_dir(st, fat32_bpb.root_clus);
+    while (st->pending > 0) {
+        uint32_t dir_cluster = chkdsk_dir_stack[--st->pending];
+        bool complete;
+        uint32_t dir_length = chkdsk_walk_chain(ahci_base, port, st, dir_cluster, &complete);
+        if (dir_length == 0) continue; // Already seen or unusable
+        st->directories++;
+
+        dir_iter_t it;
+        dir_scan_t scan;
+        const uint8_t* sector;
+        dir_iter_start(&it, dir_cluster);
+        while ((sector = dir_iter_next_sector(ahci_base, port, &it, nullptr)) != nullptr) {
+            if (it.hops >= dir_length) break; // Chain joined another one; stop at the join
+            dir_scan_sector(sector, nullptr, &scan);
+            for (uint32_t bits = scan.live; bits; bits &= bits - 1)
+                chkdsk_check_entry(ahci_base, port, st, (const fat_dir_entry_t*)(sector + __builtin_ctz(bits) * ENTRY_SIZE));
+            if (scan.end) break;
+        }
+        if (it.error) st->incomplete = true;
+    }
+}
+
+static bool chkdsk_chain_shared(uint64_t ahci_base, int port, chkdsk_state_t* st, uint32_t cluster) {
+    for (uint32_t steps = 0; cluster >= 2 && cluster < st->max_clusters && steps < st->max_clusters; steps++) {
+        if (st->shared->test(cluster)) return true;
+        cluster = read_fat_entry(ahci_base, port, cluster);
+    }
+    return false;
+}
+
+// Lists every file and directory whose chain includes a shared cluster. Runs only after
+// cross-links were found; phase 1 already broke any loops, and the walk visits no more
+// directories than phase 1 counted.
+static void chkdsk_list_shared(uint64_t ahci_base, int port, chkdsk_state_t* st) {
+    uint32_t visited = 0;
+    st->pending = 0;
+    chkdsk_push_dir(st, fat32_bpb.root_clus);
+    while (st->pending > 0 && visited++ < st->directories) {
+        dir_iter_t it;
+        dir_scan_t scan;
+        const uint8_t* sector;
+        dir_iter_start(&it, chkdsk_dir_stack[--st->pending]);
+        while ((sector = dir_iter_next_sector(ahci_base, port, &it, nullptr)) != nullptr) {
+            dir_scan_sector(sector, nullptr, &scan);
+            for (uint32_t bits = scan.live; bits; bits &= bits - 1) {
+                const fat_dir_entry_t* entry = (const fat_dir_entry_t*)(sector + __builtin_ctz(bits) * ENTRY_SIZE);
+                if (entry->name[0] == '.') continue;
+                uint32_t first_cluster = (entry->fst_clus_hi << 16) | entry->fst_clus_lo;
+                if (entry->attr & ATTR_DIRECTORY) chkdsk_push_dir(st, first_cluster);
+                if (!chkdsk_chain_shared(ahci_base, port, st, first_cluster)) continue;
+                char name[13];
+                from_83_format(entry->name, name);
+                cout << "  " << name << ((entry->attr & ATTR_DIRECTORY) ? " <DIR>" : "") << " (chain at " << first_cluster << ")\n";
+            }
+            if (scan.end) break;
+        }
+    }
+}
+
+// Phase 2: frees every cluster the FAT marks as used but phase 1 never reached.
+// Bad-cluster markers are left alone.
+static chkdsk_reclaim_t chkdsk_reclaim_orphans(uint64_t ahci_base, int port, const Bitmap& reached, uint32_t max_clusters) {
+    chkdsk_reclaim_t result = { -1, 0 };
+    if (!fat32_flush_fat(ahci_base, port)) return result; // The disk copy must be current
+    const uint32_t entries_per_read = sizeof(fat_scan_buffer) / 4; // Multiple of 32
+    uint32_t* fat = (uint32_t*)fat_scan_buffer;
+    uint32_t reclaimed = 0, lost_links = 0;
+    for (uint32_t base = 0; base < max_clusters; base += entries_per_read) {
+        uint32_t entries = max_clusters - base;
+        if (entries > entries_per_read) entries = entries_per_read;
+        uint32_t sectors = (entries * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        uint32_t fat_sector = base / (SECTOR_SIZE / 4);
+        if (read_sectors(ahci_base, port, fat_start_sector + fat_sector, sectors, fat_scan_buffer) != 0) return result;
+
+        bool changed = false;
+        for (uint32_t w = 0; w * 32 < entries; w++) {
+            uint32_t count = entries - w * 32;
+            if (count > 32) count = 32;
+            uint32_t used = 0;
+            for (uint32_t b = 0; b < count; b++) {
+                uint32_t value = fat[w * 32 + b] & 0x0FFFFFFF;
+                if (value != FAT_FREE_CLUSTER && value != FAT_BAD_CLUSTER) used |= 1u << b;
+            }
+            if (base == 0 && w == 0) used &= ~3u; // Entries 0 and 1 are reserved
+            uint32_t orphans = used & ~reached.word((base / 32) + w);
+            while (orphans) {
+                uint32_t b = __builtin_ctz(orphans);
+                orphans &= orphans - 1;
+                uint32_t cluster = base + w * 32 + b;
+                uint32_t next = fat[w * 32 + b] & 0x0FFFFFFF;
+                // Every orphan linking to another orphan joins two clusters of one lost chain.
+                if (next >= 2 && next < max_clusters && !reached.test(next)) lost_links++;
+                fat[w * 32 + b] &= 0xF0000000;
+                if (free_map_ready) free_cluster_map->clear(cluster);
+                if (free_cluster_count != FSINFO_UNKNOWN) free_cluster_count++;
+                if (cluster == dir_buffer_cluster) dir_buffer_cluster = 0;
+                reclaimed++;
+                changed = true;
+            }
+        }
+        if (!changed) continue;
+        fsinfo_dirty = true;
+        writeback_arm(); // The corrected free count reaches FSInfo at the next write-back
+        fat_cache_invalidate(); // Cached blocks may now be stale
+        for (uint8_t i = 0; i < fat32_bpb.num_fats; i++) {
+            if (write_sectors(ahci_base, port, fat_start_sector + i * fat32_bpb.fat_sz32 + fat_sector, sectors, fat_scan_buffer) != 0) return result;
+        }
+    }
+    result.reclaimed = reclaimed;
+    result.lost_chains = reclaimed - lost_links;
+    return result;
+}
+
+void cmd_chkdsk(uint64_t ahci_base, int port) {
+    cout << "Checking filesystem for errors...\n";
+    uint32_t start_ticks = timer_ticks;
+
+    uint32_t max_clusters = fat32_max_clusters();
+    if (max_clusters > FREE_MAP_MAX_CLUSTERS || max_clusters > fat32_bpb.fat_sz32 * (SECTOR_SIZE / 4)) {
+        cout << "Error: Volume geometry not supported by chkdsk.\n";
+        return;
+    }
+    Bitmap reached, shared;
+    reached.attach(chkdsk_reach_storage, max_clusters);
+    shared.attach(chkdsk_shared_storage, max_clusters);
+    chkdsk_state_t st;
+    simple_memset(&st, 0, sizeof(st));
+    st.reached = &reached;
+    st.shared = &shared;
+    st.max_clusters = max_clusters;
+
+    cout << "Phase 1: Verifying files and directories...\n";
+    chkdsk_scan_tree(ahci_base, port, &st);
+    cout << st.files << " files in " << st.directories << " directories.\n";
+
+    chkdsk_reclaim_t orphans = { 0, 0 };
+    if (st.incomplete) {
+        cout << "Warning: Directory tree could not be fully read. Skipping orphan reclaim.\n";
+        if (!fat32_flush_fat(ahci_base, port)) orphans.reclaimed = -1;
+    } else {
+        cout << "Phase 2: Verifying file allocation table...\n";
+        orphans = chkdsk_reclaim_orphans(ahci_base, port, reached, max_clusters);
+    }
+
+    uint32_t elapsed_ms = (timer_ticks - start_ticks) * (1000 / PIT_FREQUENCY_HZ);
+    uint32_t fat_kb = (max_clusters * 4 + 1023) / 1024;
+    uint32_t problems = st.cross_links + st.loops + st.broken_chains + st.size_mismatches;
+    if (orphans.reclaimed < 0) {
+        cout << "\nCHKDSK aborted: Error reading or writing the FAT.\n";
+        return;
+    }
+    if (st.cross_links) {
+        cout << "Cross-linked clusters:  " << st.shared_clusters << " in " << st.cross_links << " joined chains (left in place)\n";
+        chkdsk_list_shared(ahci_base, port, &st);
+    }
+    if (st.loops) cout << "Looping chains broken:  " << st.loops << "\n";
+    if (st.broken_chains) cout << "Broken chains ended:    " << st.broken_chains << "\n";
+    if (st.size_mismatches) cout << "Size/chain mismatches:  " << st.size_mismatches << "\n";
+    if (orphans.reclaimed > 0) {
+        cout << "\nCHKDSK finished. Reclaimed " << orphans.reclaimed << " orphaned clusters in "
+             << orphans.lost_chains << " lost chains.\n";
+    } else if (problems > 0) {
+        cout << "\nCHKDSK finished. " << problems << " problems found.\n";
+    } else {
+        cout << "\nCHKDSK finished. No errors found.\n";
+    }
+    cout << "Scanned " << fat_kb << " KB of FAT in " << elapsed_ms << " ms";
+    if (elapsed_ms > 0) cout << " (" << fat_kb * 1000 / elapsed_ms << " KB/s)";
+    cout << ".\n";
+}
+
+// --- FILE HANDLES ---
+// Open files keep a copy of their directory entry and an extent map of their chain: runs of
+// physically consecutive clusters, built by one walk of the FAT on first access. A file
+// offset resolves to a cluster by binary search over the runs, so seeks cost no FAT reads.
+// Chains with more runs than the map holds continue past it with a cursor that remembers
+// the last cluster visited. All transfers go straight between the caller's buffer and disk.
+#define FAT32_MAX_OPEN_FILES 8
+#define FILE_MAX_EXTENTS 64
+#define FILE_WB_BYTES 4096 // Per-handle buffer gathering small consecutive writes
+
+typedef struct {
+    uint32_t index;   // Position of the run's first cluster within the file's chain
+    uint32_t cluster; // First cluster of the run
+    uint32_t length;  // Clusters in the run
+} file_extent_t;
+
+static file_extent_t file_extents[FAT32_MAX_OPEN_FILES][FILE_MAX_EXTENTS];
+static uint8_t file_wb_buffers[FAT32_MAX_OPEN_FILES][FILE_WB_BYTES];
+
+typedef struct {
+    bool in_use;
+    bool dirty;              // entry changed since it was last written to disk
+    uint32_t dir_cluster;    // Directory holding the entry
+    dir_pos_t dir_pos;
+    fat_dir_entry_t entry;
+    uint32_t position;       // Byte offset of the next read or write
+    uint32_t cursor_cluster; // Cluster number cursor_index of the chain, 0 if unset
+    uint32_t cursor_index;
+    bool map_valid;          // file_extents[handle] describes the start of the chain
+    bool map_complete;       // ... and reaches the end of it
+    uint16_t extent_count;
+    uint32_t ra_expected;    // Position where the next read continues the sequential stream
+    uint32_t ra_window;      // Read-ahead size in bytes, 0 while access looks random
+    uint32_t wb_start;       // File offset of file_wb_buffers[handle][0]
+    uint32_t wb_length;      // Buffered bytes not yet on disk
+} fat32_file_t;
+
+static fat32_file_t open_files[FAT32_MAX_OPEN_FILES];
+
+// Read-ahead: one buffer, filled in the background for the most recent sequential reader.
+// It holds file bytes [readahead_start, readahead_start + readahead_bytes) of handle
+// readahead_fd; the data is valid once ahci_async_wait() reports success.
+#define READAHEAD_MIN_BYTES 4096
+#define READAHEAD_MAX_BYTES (MAX_TRANSFER_SECTORS * SECTOR_SIZE)
+
+static uint8_t readahead_buffer[READAHEAD_MAX_BYTES] __attribute__((aligned(4)));
+static int readahead_fd = -1;
+static uint32_t readahead_start;
+static uint32_t readahead_bytes;
+
+// Drops every handle without writing anything back; used when the volume changes.
+void fat32_close_all_files() {
+    for (int i = 0; i < FAT32_MAX_OPEN_FILES; i++) open_files[i].in_use = false;
+    readahead_fd = -1;
+}
+
+static fat32_file_t* file_from_handle(int fd) {
+    if (fd < 0 || fd >= FAT32_MAX_OPEN_FILES || !open_files[fd].in_use) return nullptr;
+    return &open_files[fd];
+}
+
+static bool file_is_open(dir_pos_t pos) {
+    for (int i = 0; i < FAT32_MAX_OPEN_FILES; i++) {
+        if (open_files[i].in_use && open_files[i].dir_pos.lba == pos.lba && open_files[i].dir_pos.slot == pos.slot) return true;
+    }
+    return false;
+}
+
+static inline uint32_t file_first_cluster(const fat32_file_t* f) {
+    return ((uint32_t)f->entry.fst_clus_hi << 16) | f->entry.fst_clus_lo;
+}
+
+static inline file_extent_t* file_map(const fat32_file_t* f) {
+    return file_extents[f - open_files];
+}
+
+// Number of chain clusters covered by the extent map.
+static inline uint32_t file_map_end(const fat32_file_t* f) {
+    if (f->extent_count == 0) return 0;
+    const file_extent_t* last = &file_map(f)[f->extent_count - 1];
+    return last->index + last->length;
+}
+
+// Follows the chain from 'cluster' (the next cluster after the mapped ones) and records
+// its runs until the end of the chain or until the map is full.
+static bool file_map_walk(uint64_t ahci_base, int port, fat32_file_t* f, uint32_t cluster) {
+    file_extent_t* map = file_map(f);
+    uint32_t index = file_map_end(f);
+    while (cluster >= 2 && cluster < FAT_BAD_CLUSTER) {
+        file_extent_t* last = (f->extent_count > 0) ? &map[f->extent_count - 1] : nullptr;
+        if (last && last->cluster + last->length == cluster) {
+            last->length++;
+        } else if (f->extent_count < FILE_MAX_EXTENTS) {
+            map[f->extent_count].index = index;
+            map[f->extent_count].cluster = cluster;
+            map[f->extent_count].length = 1;
+            f->extent_count++;
+        } else {
+            f->map_complete = false; // Remaining runs are reached through the cursor
+            return true;
+        }
+        index++;
+        cluster = read_fat_entry(ahci_base, port, cluster);
+    }
+    if (cluster == FAT_BAD_CLUSTER) return false; // Read error or bad link
+    f->map_complete = true;
+    return true;
+}
+
+static bool file_map_build(uint64_t ahci_base, int port, fat32_file_t* f) {
+    f->extent_count = 0;
+    f->map_valid = false;
+    if (!file_map_walk(ahci_base, port, f, file_first_cluster(f))) return false;
+    f->map_valid = true;
+    return true;
+}
+
+// Returns the mapped run holding chain index 'index', or null if the map does not reach it.
+static file_extent_t* file_map_find(fat32_file_t* f, uint32_t index) {
+    if (index >= file_map_end(f)) return nullptr;
+    file_extent_t* map = file_map(f);
+    int lo = 0, hi = f->extent_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (map[mid].index <= index) lo = mid; else hi = mid - 1;
+    }
+    return &map[lo];
+}
+
+// Returns the cluster with the given index in the file's chain, from the extent map when
+// it covers the index and otherwise by walking forward from the cursor or the last mapped
+// cluster. Returns 0 if the chain is shorter than that.
+static uint32_t file_cluster_at(uint64_t ahci_base, int port, fat32_file_t* f, uint32_t index) {
+    if (!f->map_valid && !file_map_build(ahci_base, port, f)) return 0;
+    file_extent_t* run = file_map_find(f, index);
+    if (run) return run->cluster + (index - run->index);
+    if (f->map_complete) return 0;
+
+    uint32_t cluster = f->cursor_cluster, at = f->cursor_index;
+    if (cluster == 0 || index < at || at < file_map_end(f) - 1) {
+        file_extent_t* last = &file_map(f)[f->extent_count - 1];
+        cluster = last->cluster + last->length - 1;
+        at = last->index + last->length - 1;
+    }
+    while (at < index && cluster >= 2 && cluster < FAT_BAD_CLUSTER) {
+        cluster = read_fat_entry(ahci_base, port, cluster);
+        at++;
+    }
+    if (cluster < 2 || cluster >= FAT_BAD_CLUSTER) return 0;
+    f->cursor_cluster = cluster;
+    f->cursor_index = index;
+    return cluster;
+}
+
+// Like file_cluster_at, and also stores in *run how many physically consecutive clusters
+// start there. Past the map the run is measured from the FAT, up to 'wanted_bytes'.
+static uint32_t file_run_at(uint64_t ahci_base, int port, fat32_file_t* f, uint32_t index, uint32_t wanted_bytes, uint32_t* run) {
+    uint32_t cluster = file_cluster_at(ahci_base, port, f, index);
+    if (cluster == 0) return 0;
+    file_extent_t* extent = file_map_find(f, index);
+    if (extent) {
+        *run = extent->length - (index - extent->index);
+        return cluster;
+    }
+    uint32_t next;
+    uint32_t last = contiguous_run_end(ahci_base, port, cluster, wanted_bytes, &next);
+    *run = last - cluster + 1;
+    f->cursor_cluster = last;
+    f->cursor_index = index + *run - 1;
+    return cluster;
+}
+
+// Reads 'bytes' starting 'skip' bytes into the sector at 'lba'.
+static bool read_span(uint64_t ahci_base, int port, uint64_t lba, uint32_t skip, uint8_t* dest, uint32_t bytes) {
+    if (skip > 0) {
+        uint8_t sector_buffer[SECTOR_SIZE];
+        uint32_t n = (bytes < SECTOR_SIZE - skip) ? bytes : SECTOR_SIZE - skip;
+        if (read_sectors(ahci_base, port, lba, (uint32_t)1, sector_buffer) != 0) return false;
+        simple_memcpy(dest, sector_buffer + skip, n);
+        dest += n;
+        bytes -= n;
+        lba++;
+    }
+    return bytes == 0 || read_contiguous(ahci_base, port, lba, dest, bytes);
+}
+
+// Writes 'bytes' starting 'skip' bytes into the sector at 'lba'. Whole sectors are written
+// directly; partial sectors at either end are read-modify-written to keep their other bytes.
+static bool write_span(uint64_t ahci_base, int port, uint64_t lba, uint32_t skip, const uint8_t* src, uint32_t bytes) {
+    uint8_t sector_buffer[SECTOR_SIZE];
+    if (skip > 0 || bytes < SECTOR_SIZE) {
+        uint32_t n = (bytes < SECTOR_SIZE - skip) ? bytes : SECTOR_SIZE - skip;
+        if (read_sectors(ahci_base, port, lba, (uint32_t)1, sector_buffer) != 0) return false;
+        simple_memcpy(sector_buffer + skip, src, n);
+        if (write_sectors(ahci_base, port, lba, (uint32_t)1, sector_buffer) != 0) return false;
+        src += n;
+        bytes -= n;
+        lba++;
+    }
+    uint32_t whole_bytes = bytes - bytes % SECTOR_SIZE;
+    if (whole_bytes > 0 && !write_contiguous(ahci_base, port, lba, src, whole_bytes)) return false;
+    src += whole_bytes;
+    bytes -= whole_bytes;
+    lba += whole_bytes / SECTOR_SIZE;
+    if (bytes > 0) {
+        if (read_sectors(ahci_base, port, lba, (uint32_t)1, sector_buffer) != 0) return false;
+        simple_memcpy(sector_buffer, src, bytes);
+        if (write_sectors(ahci_base, port, lba, (uint32_t)1, sector_buffer) != 0) return false;
+    }
+    return true;
+}
+
+// Writes 'length' bytes at file offset 'pos' straight to disk; the clusters must already
+// be reserved.
+static bool file_write_at(uint64_t ahci_base, int port, fat32_file_t* f, uint32_t pos, const uint8_t* src, uint32_t length) {
+    uint32_t cluster_size = fat32_bpb.sec_per_clus * SECTOR_SIZE;
+    uint32_t done = 0;
+    while (done < length) {
+        uint32_t offset = pos % cluster_size;
+        uint32_t run;
+        uint32_t cluster = file_run_at(ahci_base, port, f, pos / cluster_size, offset + (length - done), &run);
+        if (cluster == 0) return false;
+        uint64_t run_bytes = (uint64_t)run * cluster_size - offset;
+        uint32_t n = (run_bytes < length - done) ? (uint32_t)run_bytes : length - done;
+        if (!write_span(ahci_base, port, cluster_to_lba(cluster) + offset / SECTOR_SIZE, offset % SECTOR_SIZE, src + done, n)) return false;
+        pos += n;
+        done += n;
+    }
+    return true;
+}
+
+static bool file_wb_flush(uint64_t ahci_base, int port, fat32_file_t* f) {
+    if (f->wb_length == 0) return true;
+    if (!file_write_at(ahci_base, port, f, f->wb_start, file_wb_buffers[f - open_files], f->wb_length)) return false;
+    f->wb_length = 0;
+    return true;
+}
+
+// Makes sure the file's chain covers 'end_bytes', appending clusters as needed.
+static bool file_reserve(uint64_t ahci_base, int port, fat32_file_t* f, uint32_t end_bytes) {
+    uint32_t wanted = clusters_needed(end_bytes);
+    uint32_t have = clusters_needed(f->entry.file_size);
+    if (wanted <= have) return true;
+    uint32_t tail = 0;
+    if (have > 0) {
+        tail = file_cluster_at(ahci_base, port, f, have - 1);
+        if (tail == 0) return false;
+        // Use clusters already linked past the end of the data before allocating more.
+        uint32_t next = read_fat_entry(ahci_base, port, tail);
+        while (have < wanted && next >= 2 && next < FAT_BAD_CLUSTER) {
+            tail = next;
+            have++;
+            next = read_fat_entry(ahci_base, port, tail);
+        }
+        if (have == wanted) return true;
+    }
+    uint32_t first_new = allocate_cluster_chain(ahci_base, port, wanted - have);
+    if (first_new == 0) return false;
+    if (tail == 0) {
+        f->entry.fst_clus_lo = first_new & 0xFFFF;
+        f->entry.fst_clus_hi = (first_new >> 16) & 0xFFFF;
+        f->dirty = true;
+    } else if (!write_fat_entry(ahci_base, port, tail, first_new)) {
+        free_cluster_chain(ahci_base, port, first_new);
+        return false;
+    }
+    // A map that reached the old end of chain is extended with the new runs.
+    if (f->map_valid && f->map_complete && !file_map_walk(ahci_base, port, f, first_new)) f->map_valid = false;
+    return true;
+}
+
+// Shrinks the file to 'size' bytes, marking the last kept cluster as end of chain and
+// freeing everything after it. Only the tail of the chain is touched.
+static bool file_truncate(uint64_t ahci_base, int port, fat32_file_t* f, uint32_t size) {
+    if (size >= f->entry.file_size) return true;
+    if (!file_wb_flush(ahci_base, port, f)) return false;
+    uint32_t keep = clusters_needed(size);
+    uint32_t first = file_first_cluster(f);
+    if (keep == 0) {
+        f->entry.fst_clus_lo = 0;
+        f->entry.fst_clus_hi = 0;
+        if (first >= 2) free_cluster_chain(ahci_base, port, first);
+    } else {
+        uint32_t last = file_cluster_at(ahci_base, port, f, keep - 1);
+        if (last == 0) return false;
+        uint32_t rest = read_fat_entry(ahci_base, port, last);
+        if (rest >= 2 && rest < FAT_BAD_CLUSTER) {
+            if (!write_fat_entry(ahci_base, port, last, FAT_END_OF_CHAIN)) return false;
+            free_cluster_chain(ahci_base, port, rest);
+        }
+    }
+    f->cursor_cluster = 0;
+    f->cursor_index = 0;
+    f->map_valid = false;
+    if (readahead_fd == f - open_files) readahead_fd = -1;
+    f->entry.file_size = size;
+    if (f->position > size) f->position = size;
+    f->dirty = true;
+    return true;
+}
+
+// Opens a file in the current directory, creating it empty if 'create' is set. Returns a
+// handle, or -1 on I/O error, -2 if not found or a directory, -4 if no handle or directory
+// slot is free, -5 if the file is already open.
+int fat32_open(uint64_t ahci_base, int port, const char* filename, bool create) {
+    int fd = -1;
+    for (int i = 0; i < FAT32_MAX_OPEN_FILES; i++) if (!open_files[i].in_use) { fd = i; break; }
+    if (fd < 0) return -4;
+    fat32_file_t* f = &open_files[fd];
+    uint32_t dir;
+    char target[11];
+    int status = path_resolve_parent(ahci_base, port, filename, &dir, target);
+    if (status != 0) return status;
+
+    status = dir_lookup(ahci_base, port, dir, target, &f->entry, &f->dir_pos);
+    if (status == -2 && create) {
+        if (target[0] == '.') return -2;
+        status = dir_alloc_slot(ahci_base, port, dir, &f->dir_pos);
+        if (status != 0) return status;
+        simple_memset(&f->entry, 0, sizeof(fat_dir_entry_t));
+        simple_memcpy(f->entry.name, target, 11);
+        f->entry.attr = ATTR_ARCHIVE;
+        if (dir_write_entry(ahci_base, port, dir, f->dir_pos, &f->entry) != 0) return -1;
+    } else if (status != 0) {
+        return status;
+    }
+    if (f->entry.attr & ATTR_DIRECTORY) return -2;
+    if (file_is_open(f->dir_pos)) return -5;
+
+    f->in_use = true;
+    f->dirty = false;
+    f->dir_cluster = dir;
+    f->position = 0;
+    f->cursor_cluster = 0;
+    f->cursor_index = 0;
+    f->map_valid = false;
+    f->ra_expected = 0;
+    f->ra_window = 0;
+    f->wb_length = 0;
+    if (readahead_fd == fd) readahead_fd = -1;
+    return fd;
+}
+
+// Starts a background read of the next ra_window bytes after the handle's position, limited
+// to one contiguous run and the end of the file, so it is a single command.
+static void readahead_fetch(uint64_t ahci_base, int port, int fd) {
+    fat32_file_t* f = &open_files[fd];
+    uint32_t cluster_size = fat32_bpb.sec_per_clus * SECTOR_SIZE;
+    uint32_t start = f->position - f->position % SECTOR_SIZE;
+    uint32_t offset = start % cluster_size;
+    uint32_t run;
+    uint32_t cluster = file_run_at(ahci_base, port, f, start / cluster_size, offset + f->ra_window, &run);
+    if (cluster == 0) return;
+    uint64_t bytes = (uint64_t)run * cluster_size - offset;
+    uint64_t file_left = ((uint64_t)f->entry.file_size - start + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    if (bytes > f->ra_window) bytes = f->ra_window;
+    if (bytes > file_left) bytes = file_left;
+    if (bytes == 0) return;
+    readahead_fd = -1;
+    if (ahci_read_async(ahci_base, port, cluster_to_lba(cluster) + offset / SECTOR_SIZE, (uint16_t)(bytes / SECTOR_SIZE), readahead_buffer) != 0) return;
+    readahead_fd = fd;
+    readahead_start = start;
+    readahead_bytes = (uint32_t)bytes;
+}
+
+// Reads up to 'length' bytes at the handle's position. Returns the number of bytes read
+// (0 at end of file), -1 on I/O error or -3 for a bad handle. A read that continues where
+// the previous one stopped grows the handle's read-ahead window (doubling up to 64 KB),
+// and once the buffered data is used up the next window is fetched in the background, so
+// the following read is served from memory. Any other access pattern turns it off.
+int fat32_read(uint64_t ahci_base, int port, int fd, void* buffer, uint32_t length) {
+    fat32_file_t* f = file_from_handle(fd);
+    if (!f) return -3;
+    if (!file_wb_flush(ahci_base, port, f)) return -1;
+    if (f->position >= f->entry.file_size) return 0;
+    if (length > f->entry.file_size - f->position) length = f->entry.file_size - f->position;
+
+    if (f->position == f->ra_expected) {
+        uint32_t window = f->ra_window ? f->ra_window * 2 : length;
+        if (window < READAHEAD_MIN_BYTES) window = READAHEAD_MIN_BYTES;
+        f->ra_window = (window > READAHEAD_MAX_BYTES) ? READAHEAD_MAX_BYTES : window;
+    } else {
+        f->ra_window = 0;
+        if (readahead_fd == fd) readahead_fd = -1;
+    }
+
+    uint8_t* dest = (uint8_t*)buffer;
+    uint32_t cluster_size = fat32_bpb.sec_per_clus * SECTOR_SIZE;
+    uint32_t done = 0;
+    if (readahead_fd == fd && f->position >= readahead_start && f->position - readahead_start < readahead_bytes) {
+        if (ahci_async_wait() == 0) {
+            uint32_t skip = f->position - readahead_start;
+            done = (readahead_bytes - skip < length) ? readahead_bytes - skip : length;
+            simple_memcpy(dest, readahead_buffer + skip, done);
+            f->position += done;
+        } else {
+            readahead_fd = -1; // Fall back to a direct read
+        }
+    }
+    while (done < length) {
+        uint32_t offset = f->position % cluster_size;
+        uint32_t run;
+        uint32_t cluster = file_run_at(ahci_base, port, f, f->position / cluster_size, offset + (length - done), &run);
+        if (cluster == 0) return -1; // Chain shorter than the file size
+        uint64_t run_bytes = (uint64_t)run * cluster_size - offset;
+        uint32_t n = (run_bytes < length - done) ? (uint32_t)run_bytes : length - done;
+        if (!read_span(ahci_base, port, cluster_to_lba(cluster) + offset / SECTOR_SIZE, offset % SECTOR_SIZE, dest + done, n)) return -1;
+        f->position += n;
+        done += n;
+    }
+    f->ra_expected = f->position;
+
+    bool buffered = readahead_fd == fd && f->position >= readahead_start && f->position - readahead_start < readahead_bytes;
+    if (f->ra_window > 0 && !buffered && f->position < f->entry.file_size) readahead_fetch(ahci_base, port, fd);
+    return done;
+}
+
+// Writes 'length' bytes at the handle's position, growing the file as needed. Returns the
+// number of bytes written, -1 on I/O error, -3 for a bad handle or -6 if the disk is full.
+// Writes smaller than FILE_WB_BYTES that continue one another are gathered in the
+// handle's buffer and reach the disk on read, close or the next sync point.
+int fat32_write(uint64_t ahci_base, int port, int fd, const void* buffer, uint32_t length) {
+    fat32_file_t* f = file_from_handle(fd);
+    if (!f) return -3;
+    if (length == 0) return 0;
+    if (length > 0xFFFFFFFFu - f->position) return -6; // FAT32 files stop at 4 GB
+    if (readahead_fd == fd) readahead_fd = -1;
+    if (!file_reserve(ahci_base, port, f, f->position + length)) return -6;
+
+    const uint8_t* src = (const uint8_t*)buffer;
+    if (length < FILE_WB_BYTES) {
+        bool continues = f->position == f->wb_start + f->wb_length && f->wb_length + length <= FILE_WB_BYTES;
+        if (f->wb_length > 0 && !continues && !file_wb_flush(ahci_base, port, f)) return -1;
+        if (f->wb_length == 0) f->wb_start = f->position;
+        simple_memcpy(file_wb_buffers[fd] + f->wb_length, src, length);
+        f->wb_length += length;
+    } else if (!file_wb_flush(ahci_base, port, f) || !file_write_at(ahci_base, port, f, f->position, src, length)) {
+        return -1;
+    }
+    f->position += length;
+    if (f->position > f->entry.file_size) {
+        f->entry.file_size = f->position;
+        f->dirty = true;
+    }
+    writeback_arm();
+    return length;
+}
+
+// Moves the handle's position. Seeking past the end of the file is not supported.
+// Returns 0 on success, -1 if 'offset' is beyond the end, -3 for a bad handle.
+int fat32_seek(int fd, uint32_t offset) {
+    fat32_file_t* f = file_from_handle(fd);
+    if (!f) return -3;
+    if (offset > f->entry.file_size) return -1;
+    f->position = offset;
+    return 0;
+}
+
+// Writes buffered data and, if it changed, the directory entry. FAT updates follow at the
+// next sync point. Returns 0 on success, -1 on I/O error, -3 for a bad handle.
+int fat32_close(uint64_t ahci_base, int port, int fd) {
+    fat32_file_t* f = file_from_handle(fd);
+    if (!f) return -3;
+    int status = 0;
+    if (!file_wb_flush(ahci_base, port, f)) status = -1;
+    if (f->dirty && dir_write_entry(ahci_base, port, f->dir_cluster, f->dir_pos, &f->entry) != 0) status = -1;
+    if (readahead_fd == fd) readahead_fd = -1;
+    f->in_use = false;
+    return status;
+}
+
+// Writes back everything held in memory: buffered data and directory entries of open
+// files, the FAT cache (FAT #1, then the mirrors) and FSInfo, and finally flushes the
+// drive's write cache. Returns false if any step failed.
+bool fat32_sync(uint64_t ahci_base, int port) {
+    if (exfat_mounted) return exfat_sync(ahci_base, port);
+    writeback_deadline = 0;
+    writeback_due = false;
+    bool ok = true;
+    for (int i = 0; i < FAT32_MAX_OPEN_FILES; i++) {
+        fat32_file_t* f = &open_files[i];
+        if (!f->in_use) continue;
+        if (!file_wb_flush(ahci_base, port, f)) { ok = false; continue; }
+        if (f->dirty) {
+            if (dir_write_entry(ahci_base, port, f->dir_cluster, f->dir_pos, &f->entry) == 0) f->dirty = false;
+            else ok = false;
+        }
+    }
+    if (!fat32_sync_fat_mirrors(ahci_base, port)) ok = false;
+    else if (!fat32_trim_pending(ahci_base, port)) ok = false;
+    if (!fat32_write_fsinfo(ahci_base, port)) ok = false;
+    if (ata_flush_cache(ahci_base, port) != 0) ok = false;
+    return ok;
+}
+
+// Trims every free cluster on the volume after a sync. Returns the number of clusters
+// trimmed, -1 on I/O error or -2 if the drive does not support TRIM.
+int fat32_fstrim(uint64_t ahci_base, int port) {
+    if (!trim_supported()) return -2;
+    if (!fat32_sync(ahci_base, port)) return -1;
+    trim_batch_count = 0;
+    trim_batch_failed = false;
+    uint32_t trimmed = trim_free_clusters(ahci_base, port, 2, fat32_max_clusters() - 2);
+    trim_batch_send(ahci_base, port);
+    if (trim_batch_failed) return -1;
+    return (int)trimmed;
+}
+
+// Makes bytes [offset, offset + length) of an open file equal 'src'. Where the file
+// already has data it is read back, in chunks that start at 4 KB and double, and sectors
+// that already match are skipped. At the first sector that differs the comparison stops
+// and everything from there on is overwritten, since an edit usually shifts all later
+// bytes; so a save costs at most one read of the unchanged prefix plus one write of the
+// rest. Returns 0, -1 on I/O error, -6 if the disk is full.
+static int file_update_range(uint64_t ahci_base, int port, int fd, uint32_t offset, const uint8_t* src, uint32_t length) {
+    static uint8_t compare_buffer[MAX_TRANSFER_SECTORS * SECTOR_SIZE] __attribute__((aligned(4)));
+    fat32_file_t* f = &open_files[fd];
+    uint32_t end = offset + length;
+    uint32_t overlap_end = (end < f->entry.file_size) ? end : f->entry.file_size;
+    uint32_t pos = offset;
+    uint32_t window = 4096;
+    bool differs = false;
+    while (pos < overlap_end && !differs) {
+        uint32_t chunk = overlap_end - pos;
+        if (chunk > window) chunk = window;
+        f->position = pos;
+        f->ra_expected = 0xFFFFFFFF; // Never a sequential read; the data is not read again
+        if (fat32_read(ahci_base, port, fd, compare_buffer, chunk) != (int)chunk) return -1;
+        uint32_t s = 0;
+        while (s < chunk) {
+            uint32_t n = (chunk - s < SECTOR_SIZE) ? chunk - s : SECTOR_SIZE;
+            if (simple_memcmp(compare_buffer + s, src + (pos - offset) + s, n) != 0) { differs = true; break; }
+            s += n;
+        }
+        pos += s;
+        if (window < sizeof(compare_buffer)) window *= 2;
+    }
+    if (end > pos) {
+        f->position = pos;
+        int n = fat32_write(ahci_base, port, fd, src + (pos - offset), end - pos);
+        if (n != (int)(end - pos)) return (n == -6) ? -6 : -1;
+    }
+    return 0;
+}
+
+// --- COMPRESSION ---
+// A file whose entry has NTRES_COMPRESSED set holds an 8-byte header ("LZB1" and the
+// uncompressed size) followed by independent blocks of at most COMPRESS_BLOCK input bytes.
+// Each block starts with its raw and packed lengths (16 bits each) and then carries an LZ4
+// sequence stream, or the raw bytes when the packed length is 0. The entry's file_size is
+// the stored size, so cluster accounting and chkdsk are unaffected.
+#define NTRES_COMPRESSED 0x01 // NT only uses 0x08 and 0x10 of this byte
+#define COMPRESS_MAGIC 0x31425A4C // "LZB1"
+#define COMPRESS_HEADER_SIZE 8
+#define COMPRESS_BLOCK 32768
+#define COMPRESS_BLOCK_HEADER 4
+#define COMPRESS_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define COMPRESS_TEMP_NAME "~LZCONV.TMP"
+
+static uint8_t compress_raw[COMPRESS_BLOCK + 1] __attribute__((aligned(4))); // +1 for cat's terminator
+static uint8_t compress_packed[COMPRESS_BLOCK_HEADER + COMPRESS_BLOCK] __attribute__((aligned(4)));
+
+static inline bool entry_compressed(const fat_dir_entry_t* entry) { return (entry->ntres & NTRES_COMPRESSED) != 0; }
+
+// Writes the 255-byte continuation of a length field that did not fit in its 4 bits.
+static uint8_t* lz_put_length(uint8_t* op, const uint8_t* end, uint32_t n) {
+    for (n -= 15; n >= 255; n -= 255) {
+        if (op >= end) return nullptr;
+        *op++ = 255;
+    }
+    if (op >= end) return nullptr;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// Emits one sequence: literals, then a match unless 'match' is 0 (the final sequence).
+// Returns the new output position, or nullptr if it does not fit before 'end'.
+static uint8_t* lz_emit(uint8_t* op, const uint8_t* end, const uint8_t* literals, uint32_t count, uint32_t offset, uint32_t match) {
+    if (op >= end) return nullptr;
+    uint8_t* token = op++;
+    *token = (uint8_t)((count < 15 ? count : 15) << 4);
+    if (count >= 15 && !(op = lz_put_length(op, end, count))) return nullptr;
+    if ((uint32_t)(end - op) < count) return nullptr;
+    simple_memcpy(op, literals, count);
+    op += count;
+    if (match == 0) return op;
+    if (end - op < 2) return nullptr;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(match < 15 ? match : 15);
+    if (match >= 15 && !(op = lz_put_length(op, end, match))) return nullptr;
+    return op;
+}
+
+// Greedy single-pass compressor with a hash of the last position of each 4-byte sequence.
+// Follows the LZ4 end-of-block rules (last 5 bytes literal, no match in the last 12).
+// Returns the packed size, or 0 if it would not fit in 'capacity'.
+static uint32_t lz_compress(const uint8_t* src, uint32_t length, uint8_t* dst, uint32_t capacity) {
+    static uint16_t table[1 << COMPRESS_HASH_BITS]; // Position + 1 of the last sighting, 0 if none
+    simple_memset(table, 0, sizeof(table));
+    const uint8_t* end = dst + capacity;
+    uint8_t* op = dst;
+    uint32_t anchor = 0, i = 0;
+    uint32_t limit = (length > 12) ? length - 12 : 0;
+    while (i < limit) {
+        uint32_t seq = load_le32(src + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+        uint32_t ref = table[h];
+        table[h] = (uint16_t)(i + 1);
+        if (ref == 0 || load_le32(src + ref - 1) != seq) { i++; continue; }
+        ref--;
+        uint32_t match = LZ_MIN_MATCH;
+        while (i + match < length - 5 && src[ref + match] == src[i + match]) match++;
+        if (!(op = lz_emit(op, end, src + anchor, i - anchor, i - ref, match))) return 0;
+        i += match;
+        anchor = i;
+    }
+    if (!(op = lz_emit(op, end, src + anchor, length - anchor, 0, 0))) return 0;
+    return (uint32_t)(op - dst);
+}
+
+// Decodes 'packed' bytes into exactly 'raw' bytes, checking every length and offset.
+static bool lz_decompress(const uint8_t* src, uint32_t packed, uint8_t* dst, uint32_t raw) {
+    uint32_t ip = 0, op = 0;
+    while (ip < packed) {
+        uint8_t token = src[ip++];
+        uint32_t count = token >> 4;
+        if (count == 15) {
+            uint8_t b;
+            do {
+                if (ip >= packed) return false;
+                b = src[ip++];
+                count += b;
+            } while (b == 255);
+        }
+        if (count > packed - ip || count > raw - op) return false;
+        simple_memcpy(dst + op, src + ip, count);
+        ip += count;
+        op += count;
+        if (ip == packed) break; // The final sequence has no match
+        if (packed - ip < 2) return false;
+        uint32_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return false;
+        uint32_t match = token & 15;
+        if (match == 15) {
+            uint8_t b;
+            do {
+                if (ip >= packed) return false;
+                b = src[ip++];
+                match += b;
+            } while (b == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if (match > raw - op) return false;
+        for (uint32_t k = 0; k < match; k++, op++) dst[op] = dst[op - offset]; // May overlap
+    }
+    return op == raw;
+}
+
+// Reads and checks the header at the start of a compressed file, leaving the handle
+// positioned at the first block. Returns false on I/O error or a bad magic.
+static bool compress_read_header(uint64_t ahci_base, int port, int fd, uint32_t* size) {
+    uint8_t header[COMPRESS_HEADER_SIZE];
+    open_files[fd].position = 0;
+    if (fat32_read(ahci_base, port, fd, header, sizeof(header)) != (int)sizeof(header)) return false;
+    if (load_le32(header) != COMPRESS_MAGIC) return false;
+    *size = load_le32(header + 4);
+    return true;
+}
+
+static int compress_write_header(uint64_t ahci_base, int port, int fd, uint32_t size) {
+    uint8_t header[COMPRESS_HEADER_SIZE];
+    uint32_t magic = COMPRESS_MAGIC;
+    simple_memcpy(header, &magic, 4);
+    simple_memcpy(header + 4, &size, 4);
+    return file_update_range(ahci_base, port, fd, 0, header, sizeof(header));
+}
+
+// Decodes the block at the handle's position into 'out' (COMPRESS_BLOCK bytes). Returns
+// its length, 0 at the end of the file, or -1 on I/O error or a corrupt block.
+static int compress_read_block(uint64_t ahci_base, int port, int fd, uint8_t* out) {
+    uint8_t header[COMPRESS_BLOCK_HEADER];
+    int n = fat32_read(ahci_base, port, fd, header, sizeof(header));
+    if (n == 0) return 0;
+    if (n != (int)sizeof(header)) return -1;
+    uint32_t raw = header[0] | (header[1] << 8);
+    uint32_t packed = header[2] | (header[3] << 8);
+    if (raw == 0 || raw > COMPRESS_BLOCK || packed >= raw) return -1;
+    if (packed == 0) return (fat32_read(ahci_base, port, fd, out, raw) == (int)raw) ? (int)raw : -1;
+    if (fat32_read(ahci_base, port, fd, compress_packed, packed) != (int)packed) return -1;
+    return lz_decompress(compress_packed, packed, out, raw) ? (int)raw : -1;
+}
+
+// Compresses 'data' into blocks written from 'offset' on, storing a block raw when
+// compression does not shrink it. Sets *end past the last block. Returns 0, -1 or -6.
+static int compress_write_blocks(uint64_t ahci_base, int port, int fd, uint32_t offset, const uint8_t* data, uint32_t size, uint32_t* end) {
+    for (uint32_t done = 0; done < size;) {
+        uint32_t raw = (size - done < COMPRESS_BLOCK) ? size - done : COMPRESS_BLOCK;
+        uint32_t packed = lz_compress(data + done, raw, compress_packed + COMPRESS_BLOCK_HEADER, raw - 1);
+        if (packed == 0) simple_memcpy(compress_packed + COMPRESS_BLOCK_HEADER, data + done, raw);
+        compress_packed[0] = (uint8_t)raw;
+        compress_packed[1] = (uint8_t)(raw >> 8);
+        compress_packed[2] = (uint8_t)packed;
+        compress_packed[3] = (uint8_t)(packed >> 8);
+        uint32_t stored = COMPRESS_BLOCK_HEADER + (packed ? packed : raw);
+        int status = file_update_range(ahci_base, port, fd, offset, compress_packed, stored);
+        if (status != 0) return status;
+        offset += stored;
+        done += raw;
+    }
+    *end = offset;
+    return 0;
+}
+
+// Rewrites 'filename' compressed or plain. The converted stream goes to a temporary file
+// in the same directory, whose chain is then moved into the original entry, so the file
+// keeps its attributes and timestamps. Returns 0 on success (also if the file is already
+// in that form), -1 on I/O error, -2 if the file is missing, -3 if its compressed data is
+// corrupt, -5 if it is open, -6 if the disk is full.
+int fat32_set_compressed(uint64_t ahci_base, int port, const char* filename, bool compress) {
+    int src = fat32_open(ahci_base, port, filename, false);
+    if (src < 0) return (src == -1 || src == -5) ? src : -2;
+    if (entry_compressed(&open_files[src].entry) == compress) { fat32_close(ahci_base, port, src); return 0; }
+
+    char temp[PATH_MAX_LENGTH + 12];
+    uint32_t prefix = 0;
+    for (uint32_t i = 0; filename[i] && i < PATH_MAX_LENGTH; i++) if (filename[i] == '/') prefix = i + 1;
+    simple_memcpy(temp, filename, prefix);
+    temp[prefix] = '\0';
+    simple_strcat(temp, COMPRESS_TEMP_NAME);
+    fat32_remove_file(ahci_base, port, temp); // Left over from an interrupted conversion
+    int dest = fat32_open(ahci_base, port, temp, true);
+    if (dest < 0) { fat32_close(ahci_base, port, src); return (dest == -4) ? -6 : -1; }
+
+    uint32_t size = open_files[src].entry.file_size;
+    uint32_t out = 0;
+    int result = 0;
+    if (compress) {
+        result = compress_write_header(ahci_base, port, dest, size);
+        out = COMPRESS_HEADER_SIZE;
+        while (result == 0) {
+            int n = fat32_read(ahci_base, port, src, compress_raw, COMPRESS_BLOCK);
+            if (n == 0) break;
+            if (n < 0) { result = -1; break; }
+            result = compress_write_blocks(ahci_base, port, dest, out, compress_raw, n, &out);
+        }
+    } else {
+        uint32_t expected;
+        if (!compress_read_header(ahci_base, port, src, &expected)) result = -3;
+        while (result == 0) {
+            int n = compress_read_block(ahci_base, port, src, compress_raw);
+            if (n == 0) break;
+            if (n < 0) { result = -3; break; }
+            result = file_update_range(ahci_base, port, dest, out, compress_raw, n);
+            out += n;
+        }
+        if (result == 0 && out != expected) result = -3;
+    }
+
+    fat32_close(ahci_base, port, src);
+    if (fat32_close(ahci_base, port, dest) != 0 && result == 0) result = -1;
+    if (result != 0) { fat32_remove_file(ahci_base, port, temp); return result; }
+
+    // The temporary entry is dropped first: a crash before the original entry is written
+    // leaves the original file intact and the new chain as an orphan for chkdsk.
+    uint32_t dir;
+    char name[11], temp_name[11];
+    fat_dir_entry_t entry, converted;
+    dir_pos_t pos, temp_pos;
+    to_83_format(COMPRESS_TEMP_NAME, temp_name);
+    if (path_resolve_parent(ahci_base, port, filename, &dir, name) != 0 ||
+        dir_lookup(ahci_base, port, dir, name, &entry, &pos) != 0 ||
+        dir_lookup(ahci_base, port, dir, temp_name, &converted, &temp_pos) != 0) {
+        fat32_remove_file(ahci_base, port, temp);
+        return -1;
+    }
+    uint32_t old_cluster = dir_entry_cluster(&entry);
+    uint32_t new_cluster = dir_entry_cluster(&converted);
+    converted.name[0] = DELETED_ENTRY;
+    if (dir_write_entry(ahci_base, port, dir, temp_pos, &converted) != 0) return -1;
+    entry.fst_clus_hi = converted.fst_clus_hi;
+    entry.fst_clus_lo = converted.fst_clus_lo;
+    entry.file_size = converted.file_size;
+    if (compress) entry.ntres |= NTRES_COMPRESSED;
+    else entry.ntres &= ~NTRES_COMPRESSED;
+    if (dir_write_entry(ahci_base, port, dir, pos, &entry) != 0) {
+        if (new_cluster >= 2) free_cluster_chain(ahci_base, port, new_cluster);
+        return -1;
+    }
+    if (old_cluster >= 2) free_cluster_chain(ahci_base, port, old_cluster);
+    return 0;
+}
+
+// Reads a compressed file into 'data', stopping at buffer_size - 1 bytes and terminating
+// the text like fat32_read_file_to_buffer. Returns the byte count or -1 on error.
+static int compress_read_file(uint64_t ahci_base, int port, const char* filename, uint8_t* data, uint32_t buffer_size) {
+    int fd = fat32_open(ahci_base, port, filename, false);
+    if (fd < 0) return -1;
+    uint32_t size, total = 0;
+    int n = compress_read_header(ahci_base, port, fd, &size) ? 1 : -1;
+    while (n > 0 && total < buffer_size - 1) {
+        n = compress_read_block(ahci_base, port, fd, compress_raw);
+        if (n <= 0) break;
+        uint32_t take = (n < (int)(buffer_size - 1 - total)) ? (uint32_t)n : buffer_size - 1 - total;
+        simple_memcpy(data + total, compress_raw, take);
+        total += take;
+    }
+    fat32_close(ahci_base, port, fd);
+    if (n < 0) return -1;
+    data[total] = '\0';
+    return (int)total;
+}
+
+// --- CHECKSUMS AND SCRUB ---
+// CRC32C (Castagnoli) over file data, using the SSE4.2 crc32 instruction when CPUID
+// reports it and slice-by-8 tables otherwise; both give the same value. scrub walks the
+// tree breadth-first and reads each file straight from its clusters, one physically
+// contiguous run per command, so it runs at sequential disk speed. "scrub save" records
+// every checksum in a hidden manifest in the root, which later scrubs verify against.
+#define CRC32C_POLY 0x82F63B78 // Reflected Castagnoli polynomial
+#define SCRUB_MAX_DIRS 4096
+#define SCRUB_MANIFEST_SLOTS 8192 // Power of two, filled to at most 3/4
+#define SCRUB_PATH_POOL_BYTES (256 * 1024)
+#define SCRUB_MANIFEST_PATH "/SCRUB.CRC"
+#define SCRUB_MANIFEST_NAME "SCRUB   CRC"
+#define SCRUB_PATH_MAX (PATH_MAX_DEPTH * 13 + 16)
+
+static uint32_t crc32c_table[8][256];
+static bool crc32c_ready = false;
+static bool crc32c_hardware = false;
+
+static void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32C_POLY & (0 - (c & 1)));
+        crc32c_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xFF];
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    crc32c_hardware = (ecx & (1 << 20)) != 0; // SSE4.2
+    crc32c_ready = true;
+}
+
+// Continues a CRC32C over 'length' bytes. Start from 0xFFFFFFFF and invert the result.
+static uint32_t crc32c_update(uint32_t crc, const uint8_t* p, uint32_t length) {
+    if (!crc32c_ready) crc32c_init();
+    if (crc32c_hardware) {
+        for (; length >= 4; length -= 4, p += 4) __asm__("crc32l %1, %0" : "+r"(crc) : "rm"(load_le32(p)));
+        for (; length > 0; length--) __asm__("crc32b %1, %0" : "+r"(crc) : "qm"(*p++));
+        return crc;
+    }
+    for (; length >= 8; length -= 8, p += 8) {
+        uint32_t lo = load_le32(p) ^ crc, hi = load_le32(p + 4);
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; length > 0; length--) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+static void format_hex32(uint32_t value, char* out) {
+    for (int i = 7; i >= 0; i--, value >>= 4) out[i] = "0123456789ABCDEF"[value & 15];
+    out[8] = '\0';
+}
+
+typedef struct {
+    uint32_t cluster;
+    uint16_t parent;          // Index of the parent in scrub_dirs
+    uint8_t depth;
+    char name[11];
+} scrub_dir_t;
+
+typedef struct {
+    bool used;
+    bool seen;
+    uint32_t hash;            // CRC32C of the path
+    uint32_t path;            // Offset of the path in scrub_path_pool
+    uint32_t crc;
+} scrub_sum_t;
+
+typedef struct {
+    int manifest_fd;          // Handle of the manifest being saved, or -1
+    uint32_t listed;          // Entries loaded from the old manifest
+    uint32_t malformed;       // Manifest lines skipped because they could not be parsed
+    bool truncated;           // The manifest had more entries than could be loaded
+    uint32_t files, directories, mismatches, unreadable, unlisted;
+    uint64_t bytes;
+    bool incomplete;          // Part of the tree could not be walked
+} scrub_state_t;
+
+static uint8_t scrub_buffer[MAX_TRANSFER_SECTORS * SECTOR_SIZE] __attribute__((aligned(4)));
+static scrub_dir_t scrub_dirs[SCRUB_MAX_DIRS];
+static scrub_sum_t scrub_sums[SCRUB_MANIFEST_SLOTS];
+static char scrub_path_pool[SCRUB_PATH_POOL_BYTES];
+static uint32_t scrub_pool_used = 0;
+
+static inline uint32_t scrub_path_hash(const char* path) {
+    return ~crc32c_update(0xFFFFFFFF, (const uint8_t*)path, simple_strlen(path));
+}
+
+// Returns the slot listing 'path', or the empty slot where it belongs.
+static scrub_sum_t* scrub_sum_slot(const char* path) {
+    uint32_t hash = scrub_path_hash(path);
+    uint32_t i = hash & (SCRUB_MANIFEST_SLOTS - 1);
+    while (scrub_sums[i].used && (scrub_sums[i].hash != hash || stricmp(scrub_path_pool + scrub_sums[i].path, path) != 0))
+        i = (i + 1) & (SCRUB_MANIFEST_SLOTS - 1);
+    scrub_sums[i].hash = hash;
+    return &scrub_sums[i];
+}
+
+// Computes the CRC32C of 'size' bytes of data starting at 'cluster', reading each
+// physically contiguous run with maximum-size commands. Returns false on a read error
+// or a chain that ends before the data does.
+static bool scrub_chain_crc(uint64_t ahci_base, int port, uint32_t cluster, uint32_t size, uint32_t* crc, uint64_t* bytes) {
+    uint32_t cluster_size = fat32_bpb.sec_per_clus * SECTOR_SIZE;
+    uint32_t c = 0xFFFFFFFF;
+    for (uint32_t remaining = size; remaining > 0;) {
+        if (cluster < 2 || cluster >= FAT_BAD_CLUSTER) return false;
+        uint32_t wanted = (remaining < sizeof(scrub_buffer)) ? remaining : sizeof(scrub_buffer);
+        uint32_t next;
+        uint32_t last = contiguous_run_end(ahci_base, port, cluster, wanted, &next);
+        uint64_t run_bytes = (uint64_t)(last - cluster + 1) * cluster_size;
+        uint32_t n = (run_bytes < wanted) ? (uint32_t)run_bytes : wanted;
+        if (!read_contiguous(ahci_base, port, cluster_to_lba(cluster), scrub_buffer, n)) return false;
+        c = crc32c_update(c, scrub_buffer, n);
+        *bytes += n;
+        remaining -= n;
+        cluster = next;
+    }
+    *crc = ~c;
+    return true;
+}
+
+// Computes the CRC32C of a file's data. Returns 0, -1 on read error, -2 if not found.
+int fat32_sum_file(uint64_t ahci_base, int port, const char* filename, uint32_t* crc) {
+    uint32_t dir;
+    char target[11];
+    fat_dir_entry_t entry;
+    dir_pos_t pos;
+    int status = path_resolve_parent(ahci_base, port, filename, &dir, target);
+    if (status == 0) status = dir_lookup(ahci_base, port, dir, target, &entry, &pos);
+    if (status == -1) return -1;
+    if (status != 0 || (entry.attr & ATTR_DIRECTORY)) return -2;
+    if (file_is_open(pos)) {
+        // Its newest data may still be buffered in the handle; write it out first.
+        if (!fat32_sync(ahci_base, port)) return -1;
+        status = dir_lookup(ahci_base, port, dir, target, &entry, &pos);
+        if (status != 0) return -1;
+    }
+    uint64_t bytes = 0;
+    return scrub_chain_crc(ahci_base, port, dir_entry_cluster(&entry), entry.file_size, crc, &bytes) ? 0 : -1;
+}
+
+// Builds the absolute path of scrub_dirs[index], plus 'leaf' if given.
+static void scrub_path(uint32_t index, const char* leaf, char* out) {
+    uint32_t chain[PATH_MAX_DEPTH + 1];
+    uint32_t depth = 0;
+    for (uint32_t i = index; i != 0; i = scrub_dirs[i].parent) chain[depth++] = i;
+    out[0] = '\0';
+    char name[13];
+    while (depth > 0) {
+        from_83_format(scrub_dirs[chain[--depth]].name, name);
+        simple_strcat(out, "/");
+        simple_strcat(out, name);
+    }
+    if (leaf) {
+        simple_strcat(out, "/");
+        simple_strcat(out, leaf);
+    }
+    if (out[0] == '\0') simple_strcat(out, "/");
+}
+
+// Loads "XXXXXXXX <path>" lines from the manifest into scrub_sums; lines that do not
+// parse are counted and skipped. A missing manifest leaves the table empty. Returns false
+// on a read error.
+static bool scrub_load_manifest(uint64_t ahci_base, int port, scrub_state_t* st) {
+    simple_memset(scrub_sums, 0, sizeof(scrub_sums));
+    scrub_pool_used = 0;
+    int fd = fat32_open(ahci_base, port, SCRUB_MANIFEST_PATH, false);
+    if (fd == -2) return true;
+    if (fd < 0) return false;
+    static char line[SCRUB_PATH_MAX + 10];
+    uint32_t length = 0;
+    int n;
+    while ((n = fat32_read(ahci_base, port, fd, scrub_buffer, sizeof(scrub_buffer))) > 0) {
+        for (int i = 0; i < n; i++) {
+            char c = (char)scrub_buffer[i];
+            if (c != '\n') {
+                if (length < sizeof(line) - 1) line[length++] = c;
+                continue;
+            }
+            line[length] = '\0';
+            length = 0;
+            if (line[0] == '\0') continue;
+            if (simple_strlen(line) < 10 || line[8] != ' ') { st->malformed++; continue; }
+            uint32_t crc = 0;
+            int k = 0;
+            for (; k < 8; k++) {
+                char h = line[k];
+                uint32_t digit;
+                if (h >= '0' && h <= '9') digit = h - '0';
+                else if (h >= 'A' && h <= 'F') digit = h - 'A' + 10;
+                else if (h >= 'a' && h <= 'f') digit = h - 'a' + 10;
+                else break;
+                crc = (crc << 4) | digit;
+            }
+            if (k < 8) { st->malformed++; continue; }
+            scrub_sum_t* slot = scrub_sum_slot(line + 9);
+            if (!slot->used) {
+                uint32_t path_bytes = simple_strlen(line + 9) + 1;
+                if (st->listed >= SCRUB_MANIFEST_SLOTS / 4 * 3 || path_bytes > sizeof(scrub_path_pool) - scrub_pool_used) {
+                    st->truncated = true;
+                    continue;
+                }
+                simple_memcpy(scrub_path_pool + scrub_pool_used, line + 9, path_bytes);
+                slot->path = scrub_pool_used;
+                scrub_pool_used += path_bytes;
+                slot->used = true;
+                st->listed++;
+            }
+            slot->crc = crc;
+        }
+    }
+    fat32_close(ahci_base, port, fd);
+    return n == 0;
+}
+
+// Checksums one file, checks it against the manifest and records it in the new one.
+static void scrub_file(uint64_t ahci_base, int port, scrub_state_t* st, uint32_t dir_index, const fat_dir_entry_t* entry) {
+    char name[13];
+    static char path[SCRUB_PATH_MAX];
+    from_83_format(entry->name, name);
+    scrub_path(dir_index, name, path);
+    st->files++;
+    uint32_t crc;
+    if (!scrub_chain_crc(ahci_base, port, dir_entry_cluster(entry), entry->file_size, &crc, &st->bytes)) {
+        cout << "Unreadable: " << path << "\n";
+        st->unreadable++;
+        return;
+    }
+    if (st->listed > 0) {
+        scrub_sum_t* slot = scrub_sum_slot(path);
+        if (!slot->used) st->unlisted++;
+        else {
+            slot->seen = true;
+            if (slot->crc != crc) {
+                cout << "Checksum mismatch: " << path << "\n";
+                st->mismatches++;
+            }
+        }
+    }
+    if (st->manifest_fd >= 0) {
+        static char record[SCRUB_PATH_MAX + 10];
+        format_hex32(crc, record);
+        simple_strcat(record, " ");
+        simple_strcat(record, path);
+        simple_strcat(record, "\n");
+        uint32_t length = simple_strlen(record);
+        if (fat32_write(ahci_base, port, st->manifest_fd, record, length) != (int)length) st->incomplete = true;
+    }
+}
+
+static void scrub_tree(uint64_t ahci_base, int port, scrub_state_t* st) {
+    simple_memset(&scrub_dirs[0], 0, sizeof(scrub_dir_t));
+    scrub_dirs[0].cluster = fat32_bpb.root_clus;
+    uint32_t count = 1;
+    for (uint32_t index = 0; index < count; index++) {
+        st->directories++;
+        dir_iter_t it;
+        dir_scan_t scan;
+        const uint8_t* sector;
+        dir_iter_start(&it, scrub_dirs[index].cluster);
+        while ((sector = dir_iter_next_sector(ahci_base, port, &it, nullptr)) != nullptr) {
+            dir_scan_sector(sector, nullptr, &scan);
+            for (uint32_t bits = scan.live; bits; bits &= bits - 1) {
+                const fat_dir_entry_t* entry = (const fat_dir_entry_t*)(sector + __builtin_ctz(bits) * ENTRY_SIZE);
+                if (entry->name[0] == '.') continue;
+                if (index == 0 && simple_memcmp(entry->name, SCRUB_MANIFEST_NAME, 11) == 0) continue;
+                if (!(entry->attr & ATTR_DIRECTORY)) {
+                    scrub_file(ahci_base, port, st, index, entry);
+                    continue;
+                }
+                if (count >= SCRUB_MAX_DIRS || scrub_dirs[index].depth >= PATH_MAX_DEPTH) { st->incomplete = true; continue; }
+                scrub_dir_t* dir = &scrub_dirs[count++];
+                dir->cluster = dir_entry_cluster(entry);
+                dir->parent = (uint16_t)index;
+                dir->depth = scrub_dirs[index].depth + 1;
+                simple_memcpy(dir->name, entry->name, 11);
+            }
+            if (scan.end) break;
+        }
+        if (it.error) st->incomplete = true;
+    }
+}
+
+// Checksums every file on the volume, reporting unreadable files and, if a manifest
+// exists, files whose data no longer matches it. With 'save' the manifest is rewritten.
+void cmd_scrub(uint64_t ahci_base, int port, bool save) {
+    if (!fat32_sync(ahci_base, port)) { cout << "Error: Failed to write back buffered data.\n"; return; }
+    scrub_state_t st;
+    simple_memset(&st, 0, sizeof(st));
+    st.manifest_fd = -1;
+    if (!scrub_load_manifest(ahci_base, port, &st)) { cout << "Error: Failed to read " SCRUB_MANIFEST_PATH ".\n"; return; }
+    if (save) {
+        fat32_remove_file(ahci_base, port, SCRUB_MANIFEST_PATH);
+        st.manifest_fd = fat32_open(ahci_base, port, SCRUB_MANIFEST_PATH, true);
+        if (st.manifest_fd < 0) { cout << "Error: Failed to create " SCRUB_MANIFEST_PATH ".\n"; return; }
+        open_files[st.manifest_fd].entry.attr |= ATTR_HIDDEN;
+        open_files[st.manifest_fd].dirty = true;
+    }
+
+    cout << "Scrubbing file data...\n";
+    uint32_t start_ticks = timer_ticks;
+    scrub_tree(ahci_base, port, &st);
+    uint32_t elapsed_ms = (timer_ticks - start_ticks) * (1000 / PIT_FREQUENCY_HZ);
+    if (st.manifest_fd >= 0 && fat32_close(ahci_base, port, st.manifest_fd) != 0) st.incomplete = true;
+
+    uint32_t missing = 0;
+    if (st.listed > 0)
+        for (uint32_t i = 0; i < SCRUB_MANIFEST_SLOTS; i++) if (scrub_sums[i].used && !scrub_sums[i].seen) missing++;
+    uint32_t kb = (uint32_t)(st.bytes >> 10);
+    cout << st.files << " files in " << st.directories << " directories, " << kb << " KB read in " << elapsed_ms << " ms";
+    if (elapsed_ms > 0) cout << " (" << ((kb < 4000000) ? kb * 1000 / elapsed_ms : kb / elapsed_ms * 1000) << " KB/s)";
+    cout << ", CRC32C " << (crc32c_hardware ? "(SSE4.2)" : "(table)") << ".\n";
+    if (st.unreadable) cout << "Unreadable files:       " << st.unreadable << "\n";
+    if (st.listed > 0) {
+        cout << "Checksum mismatches:    " << st.mismatches << "\n";
+        if (st.unlisted) cout << "Files not in manifest:  " << st.unlisted << "\n";
+        if (missing) cout << "Listed files missing:   " << missing << "\n";
+    } else if (!save) {
+        cout << "No manifest; run 'scrub save' to record checksums.\n";
+    }
+    if (st.malformed) cout << "Warning: Skipped " << st.malformed << " malformed manifest lines.\n";
+    if (st.truncated) cout << "Warning: Manifest too large; only its first " << st.listed << " entries were checked.\n";
+    if (st.incomplete) cout << "Warning: Scrub was incomplete.\n";
+    if (save && !st.incomplete) cout << "Checksums saved to " SCRUB_MANIFEST_PATH ".\n";
+}
+
 // --- FILE OPERATION IMPLEMENTATIONS ---
-void fat32_list_files(uint64_t ahci_base, int port) {
-    uint8_t buffer[SECTOR_SIZE];
-    uint64_t lba = cluster_to_lba(current_directory_cluster);
+void fat32_list_files(uint64_t ahci_base, int port, const char* path) {
+    uint32_t dir = current_directory_cluster;
+    if (path && path_resolve_dir(ahci_base, port, path, &dir) != 0) { cout << "Directory not found.\n"; return; }
+    dir_iter_t it;
+    dir_scan_t scan;
+    const uint8_t* sector;
+    dir_iter_start(&it, dir);
     cout << "Directory Listing:\nName          Size\n--------------------\n";
-    for (uint8_t s = 0; s < fat32_bpb.sec_per_clus; s++) {
-        if (read_sectors(ahci_base, port, lba + s, (uint32_t)1, buffer) != 0) { cout << "Error reading directory\n"; return; }
-        for (uint16_t e = 0; e < SECTOR_SIZE / ENTRY_SIZE; e++) {
-            fat_dir_entry_t *entry = (fat_dir_entry_t *)(buffer + e * ENTRY_SIZE);
-            if (entry->name[0] == 0x00) return; // End of directory
-            if (entry->name[0] == DELETED_ENTRY || (entry->attr & (ATTR_LONG_NAME | ATTR_VOLUME_ID))) continue;
+    while ((sector = dir_iter_next_sector(ahci_base, port, &it, nullptr)) != nullptr) {
+        dir_scan_sector(sector, nullptr, &scan);
+        for (uint32_t bits = scan.live; bits; bits &= bits - 1) {
+            const fat_dir_entry_t* entry = (const fat_dir_entry_t*)(sector + __builtin_ctz(bits) * ENTRY_SIZE);
+            if (dir == fat32_bpb.root_clus && simple_memcmp(entry->name, SCRUB_MANIFEST_NAME, 11) == 0) continue; // scrub's manifest
             char fname[13];
             from_83_format(entry->name, fname);
             cout << fname;
             for (int i = simple_strlen(fname); i < 14; i++) cout << " ";
-            cout << entry->file_size << "\n";
+            if (entry->attr & ATTR_DIRECTORY) cout << "<DIR>\n";
+            else cout << entry->file_size << "\n";
         }
+        if (scan.end) return; // End of directory
     }
+    if (it.error) cout << "Error reading directory\n";
 }
 
 int fat32_add_file(uint64_t ahci_base, int port, const char* filename, const void* data, uint32_t size) {
-    uint8_t buffer[SECTOR_SIZE];
-    uint64_t dir_lba = cluster_to_lba(current_directory_cluster);
+    uint32_t dir;
     char target_83[11];
-    to_83_format(filename, target_83);
+    int status = path_resolve_parent(ahci_base, port, filename, &dir, target_83);
+    if (status != 0) return status; // -1 read error, -2 missing directory
+    if (target_83[0] == '.') return -5;
+
+    fat_dir_entry_t entry;
+    dir_pos_t pos;
+    status = dir_lookup(ahci_base, port, dir, target_83, &entry, &pos);
+    if (status == 0) return -5; // Name already in use
+    if (status == -1) return -1;
 
     uint32_t first_cluster = 0;
     if (size > 0) {
@@ -544,85 +3018,331 @@ int fat32_add_file(uint64_t ahci_base, int port, const char* filename, const voi
         }
     }
 
-    for (uint8_t s = 0; s < fat32_bpb.sec_per_clus; s++) {
-        if (read_sectors(ahci_base, port, dir_lba + s, (uint32_t)1, buffer) != 0) { if (first_cluster) free_cluster_chain(ahci_base, port, first_cluster); return -1; }
-        for (uint16_t e = 0; e < SECTOR_SIZE / ENTRY_SIZE; e++) {
-            fat_dir_entry_t *entry = (fat_dir_entry_t *)(buffer + e * ENTRY_SIZE);
-            if (entry->name[0] == 0x00 || entry->name[0] == DELETED_ENTRY) {
-                simple_memcpy(entry->name, target_83, 11);
-                entry->attr = ATTR_ARCHIVE;
-                entry->file_size = size;
-                entry->fst_clus_lo = first_cluster & 0xFFFF;
-                entry->fst_clus_hi = (first_cluster >> 16) & 0xFFFF;
-                // Timestamps can be set here
-                if (write_sectors(ahci_base, port, dir_lba + s, (uint32_t)1, buffer) != 0) { if (first_cluster) free_cluster_chain(ahci_base, port, first_cluster); return -2; }
-                return 0; // Success
-            }
-        }
+    status = dir_alloc_slot(ahci_base, port, dir, &pos);
+    if (status == 0) {
+        simple_memset(&entry, 0, sizeof(entry));
+        simple_memcpy(entry.name, target_83, 11);
+        entry.attr = ATTR_ARCHIVE;
+        entry.file_size = size;
+        entry.fst_clus_lo = first_cluster & 0xFFFF;
+        entry.fst_clus_hi = (first_cluster >> 16) & 0xFFFF;
+        // Timestamps can be set here
+        status = dir_write_entry(ahci_base, port, dir, pos, &entry);
+        if (status == 0) return 0; // Success; FAT updates go out at the next sync point
+    }
+    if (first_cluster) free_cluster_chain(ahci_base, port, first_cluster);
+    return status; // -1 read error, -2 write error, -4 directory cannot grow
+}
+
+int fat32_remove_file(uint64_t ahci_base, int port, const char* filename) {
+    uint32_t dir;
+    char target[11];
+    fat_dir_entry_t entry;
+    dir_pos_t pos;
+    int status = path_resolve_parent(ahci_base, port, filename, &dir, target);
+    if (status == 0) status = dir_lookup(ahci_base, port, dir, target, &entry, &pos);
+    if (status == -1) return -1;
+    if (status != 0) return -4;
+    if (entry.attr & ATTR_DIRECTORY) return -6; // Directories go through rmdir
+    if (file_is_open(pos)) return -5;
+    uint32_t cluster = (entry.fst_clus_hi << 16) | entry.fst_clus_lo;
+    entry.name[0] = DELETED_ENTRY;
+    if (dir_write_entry(ahci_base, port, dir, pos, &entry) != 0) return -2;
+    if (cluster >= 2) free_cluster_chain(ahci_base, port, cluster);
+    return 0;
+}
+
+int fat32_read_file_to_buffer(uint64_t ahci_base, int port, const char* filename, void* data_buffer, uint32_t buffer_size) {
+    uint32_t dir;
+    char target[11];
+    fat_dir_entry_t entry;
+    dir_pos_t pos;
+    int status = path_resolve_parent(ahci_base, port, filename, &dir, target);
+    if (status == 0) status = dir_lookup(ahci_base, port, dir, target, &entry, &pos);
+    if (status == -1) return -1;
+    if (status != 0 || (entry.attr & ATTR_DIRECTORY)) return -2; // Not found
+    if (entry_compressed(&entry)) return compress_read_file(ahci_base, port, filename, (uint8_t*)data_buffer, buffer_size);
+    uint32_t cluster = (entry.fst_clus_hi << 16) | entry.fst_clus_lo;
+    uint32_t size = entry.file_size;
+    if (size == 0) { ((char*)data_buffer)[0] = '\0'; return 0; }
+    uint32_t read_size = (size < buffer_size) ? size : buffer_size - 1;
+    if (cluster >= 2 && read_data_from_clusters(ahci_base, port, cluster, data_buffer, read_size)) {
+        ((char*)data_buffer)[read_size] = '\0';
+        return read_size;
+    }
+    return -1; // Read error
+}
+
+// Replaces a file's contents in place. The existing chain is reused, growing or shrinking
+// only at the tail, and the directory entry is written once on close. The leading
+// sectors that already match are not rewritten (see file_update_range()); a compressed
+// file stays compressed, and its unchanged leading blocks are skipped the same way.
+// Returns 0 on success, -1 on I/O error, -2 if the name is a directory, -4 if the
+// directory is full, -5 if the file is open, -6 if the disk is full.
+int fat32_write_file(uint64_t ahci_base, int port, const char* filename, const void* data, uint32_t size) {
+    int fd = fat32_open(ahci_base, port, filename, true);
+    if (fd < 0) return fd;
+    fat32_file_t* f = &open_files[fd];
+    const uint8_t* src = (const uint8_t*)data;
+    uint32_t end = size;
+    int result;
+    if (entry_compressed(&f->entry)) {
+        result = compress_write_header(ahci_base, port, fd, size);
+        if (result == 0) result = compress_write_blocks(ahci_base, port, fd, COMPRESS_HEADER_SIZE, src, size, &end);
+    } else {
+        result = file_update_range(ahci_base, port, fd, 0, src, size);
+    }
+    // Cut the chain back if the new contents are shorter.
+    if (result == 0 && end < f->entry.file_size && !file_truncate(ahci_base, port, f, end)) result = -1;
+
+    if (fat32_close(ahci_base, port, fd) != 0 && result == 0) result = -1;
+    return result;
+}
+
+// Appends 'size' bytes to the end of a file, creating it if needed. Only the tail cluster
+// and any newly linked clusters are written; a compressed file gains new blocks and its
+// header's size. Returns the same codes as fat32_write_file.
+int fat32_append_file(uint64_t ahci_base, int port, const char* filename, const void* data, uint32_t size) {
+    int fd = fat32_open(ahci_base, port, filename, true);
+    if (fd < 0) return fd;
+    int result = 0;
+    if (size > 0 && entry_compressed(&open_files[fd].entry)) {
+        uint32_t logical, end;
+        if (!compress_read_header(ahci_base, port, fd, &logical)) result = -1;
+        if (result == 0) result = compress_write_blocks(ahci_base, port, fd, open_files[fd].entry.file_size, (const uint8_t*)data, size, &end);
+        if (result == 0) result = compress_write_header(ahci_base, port, fd, logical + size);
+    } else if (size > 0) {
+        open_files[fd].position = open_files[fd].entry.file_size;
+        int n = fat32_write(ahci_base, port, fd, data, size);
+        if (n != (int)size) result = (n == -6) ? -6 : -1;
+    }
+    if (fat32_close(ahci_base, port, fd) != 0 && result == 0) result = -1;
+    return result;
+}
+
+// Copies a file by streaming it through a fixed buffer. The destination chain is
+// allocated up front in one call, so it lands in a single extent when free space allows.
+// Returns 0 on success, -1 on read error, -2 if the source or the destination's directory
+// is missing, -3 on write error, -5 if the destination exists, -6 if the disk is full.
+int fat32_copy_file(uint64_t ahci_base, int port, const char* src_name, const char* dest_name) {
+    static uint8_t copy_buffer[MAX_TRANSFER_SECTORS * SECTOR_SIZE] __attribute__((aligned(4)));
+    uint32_t dest_dir;
+    char dest_target[11];
+    fat_dir_entry_t existing;
+    dir_pos_t existing_pos;
+    int status = path_resolve_parent(ahci_base, port, dest_name, &dest_dir, dest_target);
+    if (status != 0) return status;
+    status = dir_lookup(ahci_base, port, dest_dir, dest_target, &existing, &existing_pos);
+    if (status == 0) return -5;
+    if (status == -1) return -1;
+
+    int src = fat32_open(ahci_base, port, src_name, false);
+    if (src < 0) return (src == -1) ? -1 : -2;
+    int dest = fat32_open(ahci_base, port, dest_name, true);
+    if (dest < 0) { fat32_close(ahci_base, port, src); return (dest == -4) ? -6 : -1; }
+
+    // Compressed files are copied as stored, so the copy keeps the marker.
+    uint32_t size = open_files[src].entry.file_size;
+    int result = 0;
+    if (entry_compressed(&open_files[src].entry)) {
+        open_files[dest].entry.ntres |= NTRES_COMPRESSED;
+        open_files[dest].dirty = true;
     }
-    if (first_cluster) free_cluster_chain(ahci_base, port, first_cluster);
-    return -4; // No space in directory
+    if (!file_reserve(ahci_base, port, &open_files[dest], size)) result = -6;
+    while (result == 0) {
+        int n = fat32_read(ahci_base, port, src, copy_buffer, sizeof(copy_buffer));
+        if (n == 0) break;
+        if (n < 0) { result = -1; break; }
+        if (fat32_write(ahci_base, port, dest, copy_buffer, n) != n) result = -3;
+    }
+
+    fat32_close(ahci_base, port, src);
+    if (fat32_close(ahci_base, port, dest) != 0 && result == 0) result = -3;
+    if (result != 0) fat32_remove_file(ahci_base, port, dest_name);
+    return result;
 }
 
-int fat32_remove_file(uint64_t ahci_base, int port, const char* filename) {
-    uint8_t buffer[SECTOR_SIZE];
-    uint64_t lba = cluster_to_lba(current_directory_cluster);
-    char target[11];
-    to_83_format(filename, target);
-    for (uint8_t s = 0; s < fat32_bpb.sec_per_clus; s++) {
-        if (read_sectors(ahci_base, port, lba + s, (uint32_t)1, buffer) != 0) return -1;
-        for (uint16_t e = 0; e < SECTOR_SIZE / ENTRY_SIZE; e++) {
-            fat_dir_entry_t *entry = (fat_dir_entry_t *)(buffer + e * ENTRY_SIZE);
-            if (entry->name[0] == 0) return -4;
-            if (entry->name[0] == DELETED_ENTRY || (entry->attr & (ATTR_LONG_NAME | ATTR_VOLUME_ID))) continue;
-            if (simple_memcmp(entry->name, target, 11) == 0) {
-                uint32_t cluster = (entry->fst_clus_hi << 16) | entry->fst_clus_lo;
-                entry->name[0] = DELETED_ENTRY;
-                if (write_sectors(ahci_base, port, lba + s, (uint32_t)1, buffer) != 0) return -2;
-                if (cluster >= 2) free_cluster_chain(ahci_base, port, cluster);
+// Makes 'path' the current directory. Returns 0 on success, -1 on read error, -2 if it is
+// not a directory, -7 if the resulting path is too long to track.
+int fat32_chdir(uint64_t ahci_base, int port, const char* path) {
+    uint32_t cluster;
+    int status = path_resolve_dir(ahci_base, port, path, &cluster);
+    if (status != 0) return status;
+    if (!path_update_current(path)) return -7;
+    current_directory_cluster = cluster;
+    return 0;
+}
+
+// Creates directory 'path' with its "." and ".." entries. Returns 0 on success, -1 on I/O
+// error, -2 if the parent is missing or the name is invalid, -4 if the parent cannot grow,
+// -5 if the name is already in use, -6 if the disk is full.
+int fat32_mkdir(uint64_t ahci_base, int port, const char* path) {
+    uint32_t parent;
+    char name[11];
+    int status = path_resolve_parent(ahci_base, port, path, &parent, name);
+    if (status != 0) return status;
+    if (name[0] == '.' || name[0] == ' ') return -2;
+    fat_dir_entry_t entry;
+    dir_pos_t pos;
+    status = dir_lookup(ahci_base, port, parent, name, &entry, &pos);
+    if (status == 0) return -5;
+    if (status == -1) return -1;
+
+    uint32_t cluster = allocate_cluster(ahci_base, port); // Marked EOC and zero-filled
+    if (cluster == 0) return -6;
+    uint8_t sector[SECTOR_SIZE];
+    simple_memset(sector, 0, SECTOR_SIZE);
+    fat_dir_entry_t* dots = (fat_dir_entry_t*)sector;
+    uint32_t parent_ref = (parent == fat32_bpb.root_clus) ? 0 : parent; // The root is written as 0
+    simple_memcpy(dots[0].name, DOT_NAME, 11);
+    dots[0].attr = ATTR_DIRECTORY;
+    dots[0].fst_clus_lo = cluster & 0xFFFF;
+    dots[0].fst_clus_hi = (cluster >> 16) & 0xFFFF;
+    simple_memcpy(dots[1].name, DOTDOT_NAME, 11);
+    dots[1].attr = ATTR_DIRECTORY;
+    dots[1].fst_clus_lo = parent_ref & 0xFFFF;
+    dots[1].fst_clus_hi = (parent_ref >> 16) & 0xFFFF;
+    if (write_sectors(ahci_base, port, cluster_to_lba(cluster), (uint32_t)1, sector) == 0) {
+        status = dir_alloc_slot(ahci_base, port, parent, &pos);
+        if (status == 0) {
+            simple_memset(&entry, 0, sizeof(entry));
+            simple_memcpy(entry.name, name, 11);
+            entry.attr = ATTR_DIRECTORY;
+            entry.fst_clus_lo = cluster & 0xFFFF;
+            entry.fst_clus_hi = (cluster >> 16) & 0xFFFF;
+            if (dir_write_entry(ahci_base, port, parent, pos, &entry) == 0) {
+                dentry_insert(parent, name, cluster);
                 return 0;
             }
+            status = -1;
         }
+    } else {
+        status = -1;
     }
-    return -4;
+    free_cluster_chain(ahci_base, port, cluster);
+    return (status == -4) ? -4 : -1;
 }
 
-int fat32_read_file_to_buffer(uint64_t ahci_base, int port, const char* filename, void* data_buffer, uint32_t buffer_size) {
-    uint8_t dir_sector_buffer[SECTOR_SIZE];
-    uint64_t lba = cluster_to_lba(current_directory_cluster);
-    char target[11];
-    to_83_format(filename, target);
-    for (uint8_t s = 0; s < fat32_bpb.sec_per_clus; s++) {
-        if (read_sectors(ahci_base, port, lba + s, (uint32_t)1, dir_sector_buffer) != 0) { return -1; }
-        for (uint16_t e = 0; e < SECTOR_SIZE / ENTRY_SIZE; e++) {
-            fat_dir_entry_t* entry = (fat_dir_entry_t*)(dir_sector_buffer + e * ENTRY_SIZE);
-            if (entry->name[0] == 0) return -2; // Not found
-            if (entry->name[0] == DELETED_ENTRY || (entry->attr & (ATTR_LONG_NAME | ATTR_DIRECTORY | ATTR_VOLUME_ID))) continue;
-            if (simple_memcmp(entry->name, target, 11) == 0) {
-                uint32_t cluster = (entry->fst_clus_hi << 16) | entry->fst_clus_lo;
-                uint32_t size = entry->file_size;
-                if (size == 0) { ((char*)data_buffer)[0] = '\0'; return 0; }
-                uint32_t read_size = (size < buffer_size) ? size : buffer_size - 1;
-                if (cluster >= 2 && read_data_from_clusters(ahci_base, port, cluster, data_buffer, read_size)) {
-                    ((char*)data_buffer)[read_size] = '\0';
-                    return read_size;
-                }
-                return -1; // Read error
-            }
-        }
+// Removes the empty directory 'path'. Returns 0 on success, -1 on I/O error, -2 if it is
+// missing or not a directory, -5 for the root, "." / ".." or the current directory, -6 if
+// it is not empty.
+int fat32_rmdir(uint64_t ahci_base, int port, const char* path) {
+    uint32_t parent;
+    char name[11];
+    int status = path_resolve_parent(ahci_base, port, path, &parent, name);
+    if (status != 0) return status;
+    if (name[0] == '.') return -5;
+    fat_dir_entry_t entry;
+    dir_pos_t pos;
+    status = dir_lookup(ahci_base, port, parent, name, &entry, &pos);
+    if (status != 0) return status;
+    if (!(entry.attr & ATTR_DIRECTORY)) return -2;
+    uint32_t cluster = dir_entry_cluster(&entry);
+    if (cluster < 2 || cluster == fat32_bpb.root_clus || cluster == current_directory_cluster) return -5;
+
+    dir_iter_t it;
+    dir_scan_t scan;
+    const uint8_t* sector;
+    dir_iter_start(&it, cluster);
+    while ((sector = dir_iter_next_sector(ahci_base, port, &it, nullptr)) != nullptr) {
+        dir_scan_sector(sector, nullptr, &scan);
+        for (uint32_t bits = scan.live; bits; bits &= bits - 1)
+            if (sector[__builtin_ctz(bits) * ENTRY_SIZE] != '.') return -6;
+        if (scan.end) break;
     }
-    return -2; // Not found
+    if (it.error) return -1;
+
+    entry.name[0] = DELETED_ENTRY;
+    if (dir_write_entry(ahci_base, port, parent, pos, &entry) != 0) return -1;
+    dentry_remove(parent, name);
+    dentry_remove(cluster, DOTDOT_NAME);
+    dir_index_forget(cluster); // The cluster may be reused
+    free_cluster_chain(ahci_base, port, cluster);
+    return 0;
 }
 
-int fat32_write_file(uint64_t ahci_base, int port, const char* filename, const void* data, uint32_t size) {
-    fat32_remove_file(ahci_base, port, filename); // Ignore error if file doesn't exist
-    return fat32_add_file(ahci_base, port, filename, data, size);
+// Renames or moves a file or directory; a target naming an existing directory moves the
+// source into it. Returns 0 on success, -1 on read error, -2 if the source or the target's
+// directory is missing, -3 on write error, -4 if the new name exists, -5 if the source is
+// open, or is a directory holding the target or the current directory, -6 if the target
+// directory cannot grow.
+int fat32_rename_file(uint64_t ahci_base, int port, const char* old_name, const char* new_name) {
+    uint32_t old_parent, new_parent;
+    char old_target[11], new_target[11];
+    int status = path_resolve_parent(ahci_base, port, old_name, &old_parent, old_target);
+    if (status != 0) return status;
+    status = path_resolve_parent(ahci_base, port, new_name, &new_parent, new_target);
+    if (status != 0) return status;
+    if (old_target[0] == '.') return -2;
+
+    fat_dir_entry_t entry, existing;
+    dir_pos_t pos, existing_pos;
+    status = dir_lookup(ahci_base, port, old_parent, old_target, &entry, &pos);
+    if (status != 0) return status; // -1 read error, -2 file not found
+    if (file_is_open(pos)) return -5;
+    uint32_t target_dir;
+    if (dir_step(ahci_base, port, new_parent, new_target, &target_dir) == 0) {
+        new_parent = target_dir;
+        simple_memcpy(new_target, old_target, 11);
+    } else if (new_target[0] == '.') {
+        return -2;
+    }
+    status = dir_lookup(ahci_base, port, new_parent, new_target, &existing, &existing_pos);
+    if (status == 0) return -4; // Name already in use
+    if (status == -1) return -1;
+
+    bool is_dir = (entry.attr & ATTR_DIRECTORY) != 0;
+    uint32_t cluster = dir_entry_cluster(&entry);
+    if (is_dir) {
+        // current_path would go stale if the current directory sat below the source, and a
+        // directory cannot move below itself.
+        int within = dir_is_within(ahci_base, port, current_directory_cluster, cluster);
+        if (within == 0 && new_parent != old_parent) within = dir_is_within(ahci_base, port, new_parent, cluster);
+        if (within != 0) return (within < 0) ? -1 : -5;
+        dentry_remove(old_parent, old_target);
+    }
+    simple_memcpy(entry.name, new_target, 11);
+    if (new_parent == old_parent) {
+        if (dir_write_entry(ahci_base, port, old_parent, pos, &entry) != 0) return -3; // Write error
+        return 0; // Success
+    }
+
+    dir_pos_t new_pos;
+    status = dir_alloc_slot(ahci_base, port, new_parent, &new_pos);
+    if (status != 0) return (status == -4) ? -6 : -1;
+    if (dir_write_entry(ahci_base, port, new_parent, new_pos, &entry) != 0) return -3;
+    entry.name[0] = DELETED_ENTRY;
+    if (dir_write_entry(ahci_base, port, old_parent, pos, &entry) != 0) return -3;
+    if (is_dir) {
+        // Point the moved directory's ".." at its new parent.
+        fat_dir_entry_t dotdot;
+        dir_pos_t dotdot_pos;
+        uint32_t parent_ref = (new_parent == fat32_bpb.root_clus) ? 0 : new_parent;
+        dentry_remove(cluster, DOTDOT_NAME);
+        if (dir_lookup(ahci_base, port, cluster, DOTDOT_NAME, &dotdot, &dotdot_pos) == 0) {
+            dotdot.fst_clus_lo = parent_ref & 0xFFFF;
+            dotdot.fst_clus_hi = (parent_ref >> 16) & 0xFFFF;
+            if (dir_write_entry(ahci_base, port, cluster, dotdot_pos, &dotdot) != 0) return -3;
+        }
+    }
+    return 0;
 }
 
 bool fat32_format(uint64_t ahci_base, int port, uint32_t total_sectors, uint8_t sectors_per_cluster) {
     uint8_t sector[SECTOR_SIZE];
     simple_memset(sector, 0, SECTOR_SIZE);
 
+    fat_cache_invalidate(); // Cached FAT and free map describe the old volume
+    free_map_ready = false;
+    fsinfo_dirty = false;
+    fat_mirrors_stale = false; // The new BPB has mirroring on and every FAT is written
+    exfat_mounted = false;
+    trim_pending_count = 0;
+    dir_index_invalidate();
+    dentry_clear();
+    dir_buffer_cluster = 0;
+    fat32_close_all_files();
+
     // --- 1. Validate Parameters ---
     if (total_sectors < 65536) {
         cout << "Error: Disk too small. Minimum 65536 sectors required for FAT32.\n";
@@ -634,15 +3354,37 @@ bool fat32_format(uint64_t ahci_base, int port, uint32_t total_sectors, uint8_t
     }
 
     // --- 2. Calculate Geometry ---
-    uint32_t reserved_sectors = 32;
-    uint32_t fat_size;
-    uint32_t clusters;
-
-    // A standard, direct formula to calculate FAT size correctly
-    uint32_t numerator = total_sectors - reserved_sectors;
-    uint32_t denominator = sectors_per_cluster + (512 / SECTOR_SIZE); // (sectors_per_cluster + 2*4/512) -> simplified
-    clusters = numerator / denominator;
-    
+    // FAT copies start on a 4 KiB (or physical sector) boundary and the data region on a
+    // 1 MiB boundary, relative to the drive's first aligned logical sector. Reserved
+    // sectors absorb the padding, so clusters never straddle physical sectors on 512e drives.
+    uint32_t fat_align = 8;         // 4 KiB
+    uint32_t data_align = 2048;     // 1 MiB
+    uint32_t alignment_offset = 0;
+    if (ata_drive_info.valid) {
+        uint32_t physical_sectors = ata_drive_info.physical_sector_size / SECTOR_SIZE;
+        if (physical_sectors > fat_align) fat_align = physical_sectors;
+        alignment_offset = ata_drive_info.alignment_offset % fat_align;
+    }
+
+    // Start from the classic estimate, then grow the FAT until it covers every cluster the
+    // aligned layout actually leaves (padding shrinks the data region, rounding grows it).
+    uint32_t clusters = (total_sectors - 32) / (sectors_per_cluster + (512 / SECTOR_SIZE));
+    uint32_t fat_size = ((clusters + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    uint32_t reserved_sectors, data_start;
+    for (;;) {
+        fat_size = (fat_size + fat_align - 1) / fat_align * fat_align;
+        uint32_t fats_total = 2 * fat_size;
+        data_start = (32 + fats_total - alignment_offset + data_align - 1) / data_align * data_align + alignment_offset;
+        reserved_sectors = data_start - fats_total;
+        if (reserved_sectors > 0xFFFF || data_start >= total_sectors) {
+            cout << "Error: Disk too small for an aligned FAT32 layout.\n";
+            return false;
+        }
+        clusters = (total_sectors - data_start) / sectors_per_cluster;
+        if ((uint64_t)fat_size * (SECTOR_SIZE / 4) >= (uint64_t)clusters + 2) break;
+        fat_size = ((clusters + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    }
+
     // Check if cluster count is sufficient for FAT32
     if (clusters < 65525) {
         cout << "Error: Not enough clusters for FAT32.\n";
@@ -651,8 +3393,6 @@ bool fat32_format(uint64_t ahci_base, int port, uint32_t total_sectors, uint8_t
         return false;
     }
 
-    fat_size = (clusters * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
-
     // --- 3. Create BPB ---
     fat32_bpb_t bpb = {};
     bpb.jmp_boot[0] = 0xEB; bpb.jmp_boot[1] = 0x58; bpb.jmp_boot[2] = 0x90;
@@ -705,8 +3445,14 @@ bool fat32_format(uint64_t ahci_base, int port, uint32_t total_sectors, uint8_t
     cout << "Writing FSInfo sector...\n";
     if (write_sectors(ahci_base, port, 1, 1, sector) != 0) return false;
 
-    // --- 6. Initialize FATs ---
-    cout << "Initializing FAT tables...\n";
+    // --- 6. Initialize FATs and Root Directory ---
+    // Both FAT copies and the root cluster (the first data cluster) are one contiguous
+    // region, cleared in a single sweep before the reserved FAT entries are written.
+    cout << "Initializing FAT tables and root directory...\n";
+    if (!ata_drive_info.valid) ata_identify(ahci_base, port);
+    uint64_t root_lba = data_start + ((bpb.root_clus - 2) * sectors_per_cluster);
+    if (!clear_region(ahci_base, port, reserved_sectors, (uint32_t)(root_lba - reserved_sectors) + sectors_per_cluster)) return false;
+
     simple_memset(sector, 0, SECTOR_SIZE);
     *(uint32_t*)(sector + 0) = 0x0FFFFFF8; // Media descriptor & reserved
     *(uint32_t*)(sector + 4) = 0x0FFFFFFF; // Reserved
@@ -717,41 +3463,828 @@ bool fat32_format(uint64_t ahci_base, int port, uint32_t total_sectors, uint8_t
         if (write_sectors(ahci_base, port, fat_start, 1, sector) != 0) return false;
         fat_start += fat_size;
     }
-    
-    // Clear remaining FAT sectors
-    simple_memset(sector, 0, SECTOR_SIZE);
-    fat_start = reserved_sectors;
-    for (int i = 0; i < bpb.num_fats; ++i) {
-        for (uint32_t j = 1; j < fat_size; ++j) {
-            if (write_sectors(ahci_base, port, fat_start + j, 1, sector) != 0) return false;
+
+    // --- 7. Discard the Data Region ---
+    // Not needed for correctness; lets SSDs drop stale blocks from the previous volume.
+    if (ata_drive_info.valid && ata_drive_info.trim) {
+        cout << "Discarding data region...\n";
+        ata_trim_range_t range = { root_lba + sectors_per_cluster, total_sectors - (uint32_t)root_lba - sectors_per_cluster };
+        if (ata_trim_ranges(ahci_base, port, &range, 1) != 0) cout << "Warning: TRIM failed; continuing.\n";
+    }
+
+    cout << "Format completed successfully!\n";
+    return true;
+}
+
+// --- EXFAT ---
+// exFAT volumes are detected by fat32_init() and served here for ls, cat, cp, rm and touch.
+// Free space comes from the volume's allocation bitmap, read into free_map_storage at
+// mount (only one volume is mounted at a time) and written back by sector at sync points.
+// Files created here always get one contiguous run flagged NoFatChain, so reading,
+// copying and freeing them never walks the FAT; chained files written by other systems are
+// read through it. Paths start at the root. Names are matched as ASCII, ignoring case, and
+// other characters are shown as '?'.
+#define EXFAT_ENTRY_BITMAP 0x81
+#define EXFAT_ENTRY_FILE   0x85
+#define EXFAT_ENTRY_STREAM 0xC0
+#define EXFAT_ENTRY_NAME   0xC1
+#define EXFAT_ENTRY_IN_USE 0x80
+#define EXFAT_FLAG_ALLOC_POSSIBLE 0x01
+#define EXFAT_FLAG_NO_FAT_CHAIN   0x02
+#define EXFAT_VOLUME_DIRTY 0x0002
+#define EXFAT_FAT_BAD 0xFFFFFFF7
+#define EXFAT_FAT_EOC 0xFFFFFFFF
+#define EXFAT_NAME_CHARS 15 // UTF-16 units per name entry
+#define EXFAT_MAX_NAME 255
+#define EXFAT_MAX_SET (2 + (EXFAT_MAX_NAME + EXFAT_NAME_CHARS - 1) / EXFAT_NAME_CHARS)
+#define EXFAT_MAX_BITMAP_SECTORS (FREE_MAP_MAX_CLUSTERS / 8 / SECTOR_SIZE)
+#define EXFAT_DEFAULT_TIMESTAMP 0x00210000 // 1980-01-01 00:00; there is no clock
+
+typedef struct {
+    uint8_t  jump_boot[3];
+    char     fs_name[8];
+    uint8_t  must_be_zero[53];
+    uint64_t partition_offset;
+    uint64_t volume_length;
+    uint32_t fat_offset;
+    uint32_t fat_length;
+    uint32_t cluster_heap_offset;
+    uint32_t cluster_count;
+    uint32_t root_cluster;
+    uint32_t serial;
+    uint16_t fs_revision;
+    uint16_t volume_flags;
+    uint8_t  bytes_per_sector_shift;
+    uint8_t  sectors_per_cluster_shift;
+    uint8_t  number_of_fats;
+    uint8_t  drive_select;
+    uint8_t  percent_in_use;
+} __attribute__((packed)) exfat_boot_t;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  secondary_count;
+    uint16_t set_checksum;
+    uint16_t attributes;
+    uint16_t reserved1;
+    uint32_t create_time;
+    uint32_t modify_time;
+    uint32_t access_time;
+    uint8_t  create_10ms;
+    uint8_t  modify_10ms;
+    uint8_t  create_utc;
+    uint8_t  modify_utc;
+    uint8_t  access_utc;
+    uint8_t  reserved2[7];
+} __attribute__((packed)) exfat_file_entry_t;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  flags;
+    uint8_t  reserved1;
+    uint8_t  name_length;
+    uint16_t name_hash;
+    uint16_t reserved2;
+    uint64_t valid_data_length;
+    uint32_t reserved3;
+    uint32_t first_cluster;
+    uint64_t data_length;
+} __attribute__((packed)) exfat_stream_entry_t;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  flags;
+    uint16_t name[EXFAT_NAME_CHARS];
+} __attribute__((packed)) exfat_name_entry_t;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  flags;
+    uint8_t  reserved[18];
+    uint32_t first_cluster;
+    uint64_t data_length;
+} __attribute__((packed)) exfat_bitmap_entry_t;
+
+// A file's entry set: the file entry, its stream extension and the name entries.
+typedef struct {
+    uint8_t entries[EXFAT_MAX_SET][ENTRY_SIZE];
+    dir_pos_t pos[EXFAT_MAX_SET];
+    uint32_t count;
+} exfat_set_t;
+
+typedef struct {
+    uint32_t first_cluster;
+    bool contiguous;  // NoFatChain: clusters follow one another and the FAT is not used
+    uint64_t length;  // Bytes; unused for chained directories
+} exfat_dir_t;
+
+typedef struct {
+    uint32_t cluster;       // Cluster being walked
+    uint32_t sector;        // Next sector to load within it
+    uint32_t slot;          // Next entry within the loaded chunk
+    uint32_t loaded;        // Entries in the loaded chunk
+    uint64_t chunk_lba;     // First sector of the loaded chunk
+    uint32_t clusters_left; // Clusters after this one in a contiguous directory
+    uint32_t hops;          // Clusters visited, bounds the walk on a looping chain
+    bool contiguous;
+    bool error;
+} exfat_iter_t;
+
+typedef struct {
+    uint32_t first_cluster;
+    bool contiguous;
+    uint64_t size;    // Valid data length
+    uint64_t offset;  // Next byte to read
+    uint32_t cluster; // Cluster holding 'offset', for chained files
+} exfat_reader_t;
+
+static exfat_boot_t exfat_boot;
+static uint64_t exfat_bitmap_lba = 0;         // Allocation bitmap, contiguous on disk
+static uint32_t exfat_bitmap_sectors = 0;
+static Bitmap* exfat_bitmap = nullptr;        // Bit n = cluster n + 2; wraps free_map_storage
+static uint32_t exfat_dirty_storage[EXFAT_MAX_BITMAP_SECTORS / 32];
+static Bitmap* exfat_bitmap_dirty = nullptr;  // Bitmap sectors changed since the last sync
+static uint32_t exfat_free_clusters = 0;
+static uint32_t exfat_next_free = 0;          // Allocation hint, as a bitmap index
+static bool exfat_volume_dirty = false;       // VolumeDirty is set on disk
+static bool exfat_keep_dirty = false;         // It was already set at mount; leave it for fsck
+static uint8_t exfat_fat_sector[SECTOR_SIZE] __attribute__((aligned(4)));
+static uint64_t exfat_fat_lba = 0;            // FAT sector held in exfat_fat_sector, 0 if none
+
+static inline uint32_t exfat_cluster_shift() { return 9 + exfat_boot.sectors_per_cluster_shift; }
+static inline uint32_t exfat_cluster_bytes() { return 1u << exfat_cluster_shift(); }
+static inline bool exfat_cluster_valid(uint32_t cluster) { return cluster >= 2 && cluster - 2 < exfat_boot.cluster_count; }
+static inline uint64_t exfat_cluster_lba(uint32_t cluster) {
+    return exfat_boot.cluster_heap_offset + ((uint64_t)(cluster - 2) << exfat_boot.sectors_per_cluster_shift);
+}
+static inline uint32_t exfat_clusters_for(uint64_t bytes) {
+    return (uint32_t)((bytes + exfat_cluster_bytes() - 1) >> exfat_cluster_shift());
+}
+
+static bool exfat_fat_load(uint64_t ahci_base, int port, uint32_t cluster) {
+    uint64_t lba = exfat_boot.fat_offset + cluster / (SECTOR_SIZE / 4);
+    if (exfat_fat_lba == lba) return true;
+    exfat_fat_lba = 0;
+    if (read_sectors(ahci_base, port, lba, (uint32_t)1, exfat_fat_sector) != 0) return false;
+    exfat_fat_lba = lba;
+    return true;
+}
+
+// Returns the FAT entry for 'cluster', or EXFAT_FAT_BAD on read error.
+static uint32_t exfat_fat_next(uint64_t ahci_base, int port, uint32_t cluster) {
+    if (!exfat_fat_load(ahci_base, port, cluster)) return EXFAT_FAT_BAD;
+    return ((uint32_t*)exfat_fat_sector)[cluster % (SECTOR_SIZE / 4)];
+}
+
+static bool exfat_fat_set(uint64_t ahci_base, int port, uint32_t cluster, uint32_t value) {
+    if (!exfat_fat_load(ahci_base, port, cluster)) return false;
+    ((uint32_t*)exfat_fat_sector)[cluster % (SECTOR_SIZE / 4)] = value;
+    return write_sectors(ahci_base, port, exfat_fat_lba, (uint32_t)1, exfat_fat_sector) == 0;
+}
+
+// Rewrites VolumeFlags and PercentInUse in the main boot sector. Neither is covered by the
+// boot region checksum.
+static bool exfat_write_volume_state(uint64_t ahci_base, int port, bool dirty) {
+    uint8_t sector[SECTOR_SIZE];
+    if (read_sectors(ahci_base, port, 0, (uint32_t)1, sector) != 0) return false;
+    exfat_boot_t* boot = (exfat_boot_t*)sector;
+    if (dirty) boot->volume_flags |= EXFAT_VOLUME_DIRTY;
+    else boot->volume_flags &= ~EXFAT_VOLUME_DIRTY;
+    boot->percent_in_use = (uint8_t)((exfat_boot.cluster_count - exfat_free_clusters) * 100 / exfat_boot.cluster_count);
+    return write_sectors(ahci_base, port, 0, (uint32_t)1, sector) == 0;
+}
+
+// Sets VolumeDirty before the first change after a sync, as the specification asks.
+static bool exfat_begin_update(uint64_t ahci_base, int port) {
+    if (exfat_volume_dirty) return true;
+    if (!exfat_write_volume_state(ahci_base, port, true)) return false;
+    exfat_volume_dirty = true;
+    return true;
+}
+
+// Marks 'count' clusters from 'first' in the in-memory bitmap; the sectors go out at sync.
+static void exfat_mark(uint32_t first, uint32_t count, bool used) {
+    for (uint32_t bit = first - 2; bit < first - 2 + count; bit++) {
+        if (exfat_bitmap->test(bit) == used) continue;
+        if (used) { exfat_bitmap->set(bit); exfat_free_clusters--; }
+        else { exfat_bitmap->clear(bit); exfat_free_clusters++; }
+        exfat_bitmap_dirty->set(bit / (SECTOR_SIZE * 8));
+    }
+    if (!used && first - 2 < exfat_next_free) exfat_next_free = first - 2;
+    writeback_arm();
+}
+
+// Takes 'count' contiguous free clusters, searching from the allocation hint and wrapping
+// once. Returns the first cluster, or 0 if no run is long enough.
+static uint32_t exfat_alloc_run(uint32_t count) {
+    if (count == 0 || count > exfat_free_clusters) return 0;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t pos = (pass == 0) ? exfat_next_free : 0;
+        size_t end = (pass == 0) ? exfat_boot.cluster_count : exfat_next_free;
+        while (pos < end) {
+            pos = exfat_bitmap->find_first_clear(pos);
+            if (pos >= end) break;
+            uint32_t length = exfat_bitmap->clear_run_length(pos, count);
+            if (length >= count) {
+                exfat_mark(pos + 2, count, true);
+                exfat_next_free = pos + count;
+                return pos + 2;
+            }
+            pos += length;
         }
-        fat_start += fat_size;
     }
+    return 0;
+}
 
-    // --- 7. Initialize Root Directory ---
-    cout << "Initializing root directory...\n";
-    uint32_t data_start = reserved_sectors + (bpb.num_fats * fat_size);
-    uint64_t root_lba = data_start + ((bpb.root_clus - 2) * sectors_per_cluster);
-    simple_memset(sector, 0, SECTOR_SIZE);
-    for (uint8_t i = 0; i < sectors_per_cluster; ++i) {
-        if (write_sectors(ahci_base, port, root_lba + i, 1, sector) != 0) return false;
+// Returns the clusters of a file or directory to the bitmap.
+static void exfat_free_stream(uint64_t ahci_base, int port, const exfat_stream_entry_t* stream) {
+    uint32_t cluster = stream->first_cluster;
+    if (!exfat_cluster_valid(cluster)) return;
+    uint32_t count = exfat_clusters_for(stream->data_length);
+    if (stream->flags & EXFAT_FLAG_NO_FAT_CHAIN) {
+        if (count > exfat_boot.cluster_count - (cluster - 2)) count = exfat_boot.cluster_count - (cluster - 2);
+        exfat_mark(cluster, count, false);
+        return;
+    }
+    for (uint32_t i = 0; i < count && exfat_cluster_valid(cluster); i++) {
+        uint32_t next = exfat_fat_next(ahci_base, port, cluster);
+        exfat_mark(cluster, 1, false);
+        cluster = next;
+    }
+}
+
+static void exfat_iter_start(exfat_iter_t* it, const exfat_dir_t* dir) {
+    it->cluster = dir->first_cluster;
+    it->sector = it->slot = it->loaded = 0;
+    it->contiguous = dir->contiguous;
+    uint32_t clusters = dir->contiguous ? exfat_clusters_for(dir->length) : 0;
+    it->clusters_left = clusters ? clusters - 1 : 0;
+    it->hops = 0;
+    it->error = false;
+    dir_buffer_cluster = 0; // dir_cluster_buffer is borrowed from the FAT32 iterator
+}
+
+// Returns the next raw entry and its location, or nullptr at the end of the directory's
+// clusters or on error. Clusters are loaded up to MAX_TRANSFER_SECTORS at a time.
+static uint8_t* exfat_iter_next(uint64_t ahci_base, int port, exfat_iter_t* it, dir_pos_t* pos) {
+    if (it->error) return nullptr;
+    if (it->slot >= it->loaded) {
+        uint32_t sectors_per_cluster = 1u << exfat_boot.sectors_per_cluster_shift;
+        if (it->sector >= sectors_per_cluster) {
+            if (it->contiguous) {
+                if (it->clusters_left == 0) return nullptr;
+                it->clusters_left--;
+                it->cluster++;
+            } else {
+                uint32_t next = exfat_fat_next(ahci_base, port, it->cluster);
+                if (next == EXFAT_FAT_EOC) return nullptr;
+                if (!exfat_cluster_valid(next) || ++it->hops >= exfat_boot.cluster_count) { it->error = true; return nullptr; }
+                it->cluster = next;
+            }
+            it->sector = 0;
+        }
+        if (!exfat_cluster_valid(it->cluster)) { it->error = true; return nullptr; }
+        uint32_t count = sectors_per_cluster - it->sector;
+        if (count > MAX_TRANSFER_SECTORS) count = MAX_TRANSFER_SECTORS;
+        it->chunk_lba = exfat_cluster_lba(it->cluster) + it->sector;
+        if (read_sectors(ahci_base, port, it->chunk_lba, count, dir_cluster_buffer) != 0) { it->error = true; return nullptr; }
+        it->sector += count;
+        it->loaded = count * ENTRIES_PER_SECTOR;
+        it->slot = 0;
+    }
+    pos->lba = (uint32_t)(it->chunk_lba + it->slot / ENTRIES_PER_SECTOR);
+    pos->slot = it->slot % ENTRIES_PER_SECTOR;
+    return dir_cluster_buffer + (it->slot++) * ENTRY_SIZE;
+}
+
+static inline uint16_t exfat_checksum_step(uint16_t sum, uint8_t byte) {
+    return (uint16_t)(((sum & 1) ? 0x8000 : 0) + (sum >> 1) + byte);
+}
+
+// Entry set checksum over every byte except the checksum field itself.
+static uint16_t exfat_set_checksum(const exfat_set_t* set) {
+    uint16_t sum = 0;
+    for (uint32_t i = 0; i < set->count; i++) {
+        for (uint32_t b = 0; b < ENTRY_SIZE; b++) {
+            if (i == 0 && (b == 2 || b == 3)) continue;
+            sum = exfat_checksum_step(sum, set->entries[i][b]);
+        }
     }
+    return sum;
+}
 
-    cout << "Format completed successfully!\n";
+static inline uint16_t exfat_upcase(char c) { return (c >= 'a' && c <= 'z') ? c - 32 : (uint8_t)c; }
+
+// NameHash over the up-cased UTF-16 name, low byte first.
+static uint16_t exfat_name_hash(const char* name) {
+    uint16_t hash = 0;
+    for (; *name; name++) {
+        uint16_t c = exfat_upcase(*name);
+        hash = exfat_checksum_step(hash, c & 0xFF);
+        hash = exfat_checksum_step(hash, c >> 8);
+    }
+    return hash;
+}
+
+static inline exfat_file_entry_t* exfat_set_file(exfat_set_t* set) { return (exfat_file_entry_t*)set->entries[0]; }
+static inline exfat_stream_entry_t* exfat_set_stream(exfat_set_t* set) { return (exfat_stream_entry_t*)set->entries[1]; }
+
+// Collects the rest of the entry set whose file entry the iterator just returned. Returns
+// false if the set is cut short, malformed or fails its checksum.
+static bool exfat_read_set(uint64_t ahci_base, int port, exfat_iter_t* it, const uint8_t* file_entry, dir_pos_t pos, exfat_set_t* set) {
+    uint32_t secondary = file_entry[1];
+    if (secondary < 2 || secondary >= EXFAT_MAX_SET) return false;
+    simple_memcpy(set->entries[0], file_entry, ENTRY_SIZE);
+    set->pos[0] = pos;
+    set->count = secondary + 1;
+    for (uint32_t i = 1; i < set->count; i++) {
+        uint8_t* entry = exfat_iter_next(ahci_base, port, it, &set->pos[i]);
+        if (!entry) return false;
+        simple_memcpy(set->entries[i], entry, ENTRY_SIZE);
+    }
+    return set->entries[1][0] == EXFAT_ENTRY_STREAM && exfat_set_checksum(set) == exfat_set_file(set)->set_checksum;
+}
+
+static void exfat_set_name(exfat_set_t* set, char* out) {
+    uint32_t length = exfat_set_stream(set)->name_length, j = 0;
+    for (uint32_t i = 2; i < set->count && j < length; i++) {
+        const exfat_name_entry_t* entry = (const exfat_name_entry_t*)set->entries[i];
+        if (entry->type != EXFAT_ENTRY_NAME) break;
+        for (uint32_t k = 0; k < EXFAT_NAME_CHARS && j < length; k++) {
+            uint16_t c = entry->name[k];
+            out[j++] = (c >= 0x20 && c < 0x7F) ? (char)c : '?';
+        }
+    }
+    out[j] = '\0';
+}
+
+static void exfat_set_dir(exfat_set_t* set, exfat_dir_t* dir) {
+    exfat_stream_entry_t* stream = exfat_set_stream(set);
+    dir->first_cluster = stream->first_cluster;
+    dir->contiguous = (stream->flags & EXFAT_FLAG_NO_FAT_CHAIN) != 0;
+    dir->length = stream->data_length;
+}
+
+// Finds 'name' in directory 'dir'. Returns 0 with its entry set, -1 on read error, -2 if
+// absent.
+static int exfat_find(uint64_t ahci_base, int port, const exfat_dir_t* dir, const char* name, exfat_set_t* set) {
+    uint16_t hash = exfat_name_hash(name);
+    uint32_t length = simple_strlen(name);
+    char found[EXFAT_MAX_NAME + 1];
+    exfat_iter_t it;
+    dir_pos_t pos;
+    uint8_t* entry;
+    exfat_iter_start(&it, dir);
+    while ((entry = exfat_iter_next(ahci_base, port, &it, &pos)) != nullptr) {
+        if (entry[0] == 0x00) return -2; // End of directory
+        if (entry[0] != EXFAT_ENTRY_FILE || !exfat_read_set(ahci_base, port, &it, entry, pos, set)) continue;
+        exfat_stream_entry_t* stream = exfat_set_stream(set);
+        if (stream->name_hash != hash || stream->name_length != length) continue;
+        exfat_set_name(set, found);
+        if (stricmp(found, name) == 0) return 0;
+    }
+    return it.error ? -1 : -2;
+}
+
+// Walks 'path' from the root. With 'leaf' given, the last component is copied there and
+// 'dir' is the directory meant to hold it; otherwise every component must be a directory.
+// Returns 0 on success, -1 on read error, -2 if a directory is missing or a name is bad.
+static int exfat_walk(uint64_t ahci_base, int port, const char* path, exfat_dir_t* dir, char* leaf) {
+    dir->first_cluster = exfat_boot.root_cluster;
+    dir->contiguous = false;
+    dir->length = 0;
+    char name[EXFAT_MAX_NAME + 1];
+    while (*path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+        uint32_t length = 0;
+        while (path[length] && path[length] != '/') length++;
+        if (length > EXFAT_MAX_NAME) return -2;
+        simple_memcpy(name, path, length);
+        name[length] = '\0';
+        path += length;
+        while (*path == '/') path++;
+        if (!*path && leaf) {
+            simple_memcpy(leaf, name, length + 1);
+            return 0;
+        }
+        exfat_set_t set;
+        int status = exfat_find(ahci_base, port, dir, name, &set);
+        if (status != 0) return status;
+        if (!(exfat_set_file(&set)->attributes & ATTR_DIRECTORY)) return -2;
+        exfat_set_dir(&set, dir);
+    }
+    return leaf ? -2 : 0; // A leaf was wanted but the path names no file
+}
+
+// Writes every entry of 'set' to its location, one read-modify-write per sector touched.
+static bool exfat_write_set(uint64_t ahci_base, int port, exfat_set_t* set) {
+    uint8_t sector[SECTOR_SIZE];
+    bool written[EXFAT_MAX_SET] = {false};
+    exfat_set_file(set)->set_checksum = exfat_set_checksum(set);
+    for (uint32_t i = 0; i < set->count; i++) {
+        if (written[i]) continue;
+        uint32_t lba = set->pos[i].lba;
+        if (read_sectors(ahci_base, port, lba, (uint32_t)1, sector) != 0) return false;
+        for (uint32_t j = i; j < set->count; j++) {
+            if (set->pos[j].lba != lba) continue;
+            simple_memcpy(sector + set->pos[j].slot * ENTRY_SIZE, set->entries[j], ENTRY_SIZE);
+            written[j] = true;
+        }
+        if (write_sectors(ahci_base, port, lba, (uint32_t)1, sector) != 0) return false;
+    }
+    return true;
+}
+
+// Finds room for 'count' consecutive entries in 'dir' and stores their locations in
+// set->pos. The root directory grows by one cluster if it is full; other directories do
+// not grow. Returns 0 on success, -1 on I/O error, -4 if the directory is full.
+static int exfat_alloc_entries(uint64_t ahci_base, int port, const exfat_dir_t* dir, exfat_set_t* set) {
+    exfat_iter_t it;
+    dir_pos_t pos;
+    uint8_t* entry;
+    uint32_t run = 0;
+    exfat_iter_start(&it, dir);
+    while ((entry = exfat_iter_next(ahci_base, port, &it, &pos)) != nullptr) {
+        if (entry[0] & EXFAT_ENTRY_IN_USE) { run = 0; continue; }
+        set->pos[run++] = pos;
+        if (run == set->count) return 0;
+    }
+    if (it.error) return -1;
+    uint32_t per_cluster = exfat_cluster_bytes() / ENTRY_SIZE;
+    if (dir->first_cluster != exfat_boot.root_cluster || set->count - run > per_cluster) return -4;
+
+    uint32_t cluster = exfat_alloc_run(1);
+    if (cluster == 0) return -4;
+    if (!zero_sectors(ahci_base, port, exfat_cluster_lba(cluster), 1u << exfat_boot.sectors_per_cluster_shift) ||
+        !exfat_fat_set(ahci_base, port, cluster, EXFAT_FAT_EOC) || !exfat_fat_set(ahci_base, port, it.cluster, cluster)) {
+        exfat_mark(cluster, 1, false);
+        return -1;
+    }
+    for (uint32_t i = 0; run < set->count; i++, run++) {
+        set->pos[run].lba = (uint32_t)(exfat_cluster_lba(cluster) + i / ENTRIES_PER_SECTOR);
+        set->pos[run].slot = i % ENTRIES_PER_SECTOR;
+    }
+    return 0;
+}
+
+// Fills in a new entry set for a file of 'size' bytes stored contiguously at 'cluster'.
+static void exfat_build_set(exfat_set_t* set, const char* name, uint32_t cluster, uint64_t size) {
+    uint32_t length = simple_strlen(name);
+    uint32_t name_entries = (length + EXFAT_NAME_CHARS - 1) / EXFAT_NAME_CHARS;
+    set->count = 2 + name_entries;
+    simple_memset(set->entries, 0, sizeof(set->entries));
+
+    exfat_file_entry_t* file = exfat_set_file(set);
+    file->type = EXFAT_ENTRY_FILE;
+    file->secondary_count = 1 + name_entries;
+    file->attributes = ATTR_ARCHIVE;
+    file->create_time = file->modify_time = file->access_time = EXFAT_DEFAULT_TIMESTAMP;
+
+    exfat_stream_entry_t* stream = exfat_set_stream(set);
+    stream->type = EXFAT_ENTRY_STREAM;
+    stream->flags = EXFAT_FLAG_ALLOC_POSSIBLE | (cluster ? EXFAT_FLAG_NO_FAT_CHAIN : 0);
+    stream->name_length = length;
+    stream->name_hash = exfat_name_hash(name);
+    stream->valid_data_length = stream->data_length = size;
+    stream->first_cluster = cluster;
+
+    for (uint32_t i = 0; i < length; i++) {
+        exfat_name_entry_t* entry = (exfat_name_entry_t*)set->entries[2 + i / EXFAT_NAME_CHARS];
+        entry->type = EXFAT_ENTRY_NAME;
+        entry->name[i % EXFAT_NAME_CHARS] = (uint8_t)name[i];
+    }
+}
+
+// Reads up to 'length' bytes at the reader's offset. Offsets must stay sector aligned, so
+// every read but the last should be a multiple of SECTOR_SIZE. Returns the bytes read,
+// 0 at the end of the file, or -1 on error.
+static int exfat_read(uint64_t ahci_base, int port, exfat_reader_t* r, uint8_t* dest, uint32_t length) {
+    if (r->offset >= r->size) return 0;
+    if (length > r->size - r->offset) length = (uint32_t)(r->size - r->offset);
+    uint32_t cluster_bytes = exfat_cluster_bytes();
+    uint32_t done = 0;
+    while (done < length) {
+        uint32_t within = (uint32_t)r->offset & (cluster_bytes - 1);
+        uint32_t cluster = r->contiguous ? r->first_cluster + (uint32_t)(r->offset >> exfat_cluster_shift()) : r->cluster;
+        uint32_t bytes = length - done;
+        if (!r->contiguous && bytes > cluster_bytes - within) bytes = cluster_bytes - within;
+        if (!exfat_cluster_valid(cluster)) return -1;
+        if (!read_contiguous(ahci_base, port, exfat_cluster_lba(cluster) + within / SECTOR_SIZE, dest + done, bytes)) return -1;
+        done += bytes;
+        r->offset += bytes;
+        if (!r->contiguous && ((uint32_t)r->offset & (cluster_bytes - 1)) == 0) r->cluster = exfat_fat_next(ahci_base, port, cluster);
+    }
+    return done;
+}
+
+static void exfat_reader_start(exfat_reader_t* r, exfat_set_t* set) {
+    exfat_stream_entry_t* stream = exfat_set_stream(set);
+    r->first_cluster = r->cluster = stream->first_cluster;
+    r->contiguous = (stream->flags & EXFAT_FLAG_NO_FAT_CHAIN) != 0;
+    r->size = stream->valid_data_length;
+    r->offset = 0;
+}
+
+// Allocates one contiguous run for 'size' bytes and fills it from 'src' if given, else
+// from 'data'. Sets *cluster to the run (0 for an empty file). Returns 0 on success, -1
+// on I/O error (the run is released again), -6 if no free run is long enough.
+static int exfat_store(uint64_t ahci_base, int port, uint64_t size, exfat_reader_t* src, const uint8_t* data, uint32_t* cluster) {
+    static uint8_t copy_buffer[MAX_TRANSFER_SECTORS * SECTOR_SIZE] __attribute__((aligned(4)));
+    uint32_t clusters = exfat_clusters_for(size);
+    *cluster = 0;
+    if (clusters == 0) return 0;
+    if (clusters > exfat_boot.cluster_count) return -6;
+    *cluster = exfat_alloc_run(clusters);
+    if (*cluster == 0) return -6;
+    uint64_t lba = exfat_cluster_lba(*cluster);
+    for (uint64_t done = 0; done < size; ) {
+        uint32_t bytes = (size - done < sizeof(copy_buffer)) ? (uint32_t)(size - done) : sizeof(copy_buffer);
+        bool ok = !src || exfat_read(ahci_base, port, src, copy_buffer, bytes) == (int)bytes;
+        if (!ok || !write_contiguous(ahci_base, port, lba + (done >> 9), src ? copy_buffer : data + done, bytes)) {
+            exfat_mark(*cluster, clusters, false);
+            *cluster = 0;
+            return -1;
+        }
+        done += bytes;
+    }
+    return 0;
+}
+
+// Creates 'path' holding 'size' bytes, taken from 'src' if given, else from 'data'. The
+// data goes into one contiguous run before the entry set is written. Returns 0 on success,
+// -1 on I/O error, -2 if the name or its directory is bad, -4 if the directory is full,
+// -5 if the name exists, -6 if no free run is long enough.
+static int exfat_create(uint64_t ahci_base, int port, const char* path, uint64_t size, exfat_reader_t* src, const uint8_t* data) {
+    exfat_dir_t dir;
+    char name[EXFAT_MAX_NAME + 1];
+    exfat_set_t set;
+    int status = exfat_walk(ahci_base, port, path, &dir, name);
+    if (status != 0) return status;
+    status = exfat_find(ahci_base, port, &dir, name, &set);
+    if (status == 0) return -5;
+    if (status == -1) return -1;
+    if (!exfat_begin_update(ahci_base, port)) return -1;
+
+    uint32_t clusters = exfat_clusters_for(size);
+    uint32_t cluster;
+    status = exfat_store(ahci_base, port, size, src, data, &cluster);
+    if (status == 0) {
+        exfat_build_set(&set, name, cluster, size);
+        status = exfat_alloc_entries(ahci_base, port, &dir, &set);
+        if (status == 0 && !exfat_write_set(ahci_base, port, &set)) status = -1;
+    }
+    if (status != 0 && cluster) exfat_mark(cluster, clusters, false);
+    return status;
+}
+
+bool exfat_mount(uint64_t ahci_base, int port, const uint8_t* boot_sector) {
+    simple_memcpy(&exfat_boot, boot_sector, sizeof(exfat_boot_t));
+    if (exfat_boot.bytes_per_sector_shift != 9) { cout << "exFAT: only 512-byte sectors are supported.\n"; return false; }
+    if (exfat_boot.sectors_per_cluster_shift > 16 || exfat_boot.number_of_fats != 1 || exfat_boot.cluster_count == 0) {
+        cout << "exFAT: unsupported volume layout.\n";
+        return false;
+    }
+    if (exfat_boot.cluster_count > FREE_MAP_MAX_CLUSTERS) { cout << "exFAT: too many clusters for the in-memory bitmap.\n"; return false; }
+
+    // The FAT32 state is idle while an exFAT volume is mounted; the free map storage and the
+    // directory buffer are borrowed.
+    fat32_close_all_files();
+    fat_cache_invalidate();
+    free_map_ready = false;
+    dir_index_invalidate();
+    dentry_clear();
+    exfat_fat_lba = 0;
+
+    // The root directory holds the allocation bitmap's entry.
+    exfat_dir_t root = { exfat_boot.root_cluster, false, 0 };
+    exfat_iter_t it;
+    dir_pos_t pos;
+    uint8_t* entry;
+    exfat_bitmap_entry_t bitmap;
+    bitmap.type = 0;
+    exfat_iter_start(&it, &root);
+    while ((entry = exfat_iter_next(ahci_base, port, &it, &pos)) != nullptr && entry[0] != 0x00) {
+        if (entry[0] == EXFAT_ENTRY_BITMAP) { simple_memcpy(&bitmap, entry, ENTRY_SIZE); break; }
+    }
+    uint32_t bitmap_bytes = (exfat_boot.cluster_count + 7) / 8;
+    if (bitmap.type != EXFAT_ENTRY_BITMAP || bitmap.data_length < bitmap_bytes || !exfat_cluster_valid(bitmap.first_cluster)) {
+        cout << "exFAT: allocation bitmap not found.\n";
+        return false;
+    }
+    // Sectors are written back by offset, so the bitmap must be one run on disk.
+    uint32_t bitmap_clusters = exfat_clusters_for(bitmap_bytes);
+    for (uint32_t i = 0, cluster = bitmap.first_cluster; i + 1 < bitmap_clusters; i++, cluster++) {
+        if (exfat_fat_next(ahci_base, port, cluster) != cluster + 1) { cout << "exFAT: fragmented allocation bitmap.\n"; return false; }
+    }
+    exfat_bitmap_lba = exfat_cluster_lba(bitmap.first_cluster);
+    exfat_bitmap_sectors = (bitmap_bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+    if (!exfat_bitmap) exfat_bitmap = new Bitmap();
+    if (!exfat_bitmap_dirty) exfat_bitmap_dirty = new Bitmap();
+    if (!exfat_bitmap || !exfat_bitmap_dirty) return false;
+    exfat_bitmap->attach(free_map_storage, exfat_boot.cluster_count);
+    exfat_bitmap_dirty->attach(exfat_dirty_storage, exfat_bitmap_sectors);
+    if (!read_contiguous(ahci_base, port, exfat_bitmap_lba, (uint8_t*)free_map_storage, exfat_bitmap_sectors * SECTOR_SIZE)) return false;
+    if (exfat_boot.cluster_count % 32) free_map_storage[exfat_boot.cluster_count / 32] &= (1u << (exfat_boot.cluster_count % 32)) - 1;
+
+    uint32_t used = 0;
+    for (uint32_t w = 0; w < (exfat_boot.cluster_count + 31) / 32; w++) {
+        uint32_t x = free_map_storage[w];
+        x = x - ((x >> 1) & 0x55555555);
+        x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+        used += (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+    }
+    exfat_free_clusters = exfat_boot.cluster_count - used;
+    exfat_next_free = 0;
+    exfat_volume_dirty = exfat_keep_dirty = (exfat_boot.volume_flags & EXFAT_VOLUME_DIRTY) != 0;
+    if (exfat_keep_dirty) cout << "exFAT: volume was not cleanly unmounted; run a checker on it.\n";
+    exfat_mounted = true;
+    return true;
+}
+
+// Writes dirty bitmap sectors in runs, flushes the drive and then clears VolumeDirty.
+bool exfat_sync(uint64_t ahci_base, int port) {
+    writeback_deadline = 0;
+    writeback_due = false;
+    uint32_t s = 0;
+    while (s < exfat_bitmap_sectors) {
+        if (!exfat_bitmap_dirty->test(s)) { s++; continue; }
+        uint32_t run = 1;
+        while (s + run < exfat_bitmap_sectors && run < MAX_TRANSFER_SECTORS && exfat_bitmap_dirty->test(s + run)) run++;
+        if (write_sectors(ahci_base, port, exfat_bitmap_lba + s, run, (uint8_t*)free_map_storage + s * SECTOR_SIZE) != 0) return false;
+        for (uint32_t i = 0; i < run; i++) exfat_bitmap_dirty->clear(s + i);
+        s += run;
+    }
+    if (ata_flush_cache(ahci_base, port) != 0) return false;
+    if (exfat_volume_dirty && !exfat_keep_dirty) {
+        if (!exfat_write_volume_state(ahci_base, port, false)) return false;
+        exfat_volume_dirty = false;
+    }
     return true;
 }
 
+static void exfat_print_size(uint64_t size) {
+    if (size >> 32) cout << (uint32_t)(size >> 20) << " MB";
+    else cout << (uint32_t)size;
+}
+
+void exfat_list_files(uint64_t ahci_base, int port, const char* path) {
+    exfat_dir_t dir;
+    if (exfat_walk(ahci_base, port, path ? path : "", &dir, nullptr) != 0) { cout << "Directory not found.\n"; return; }
+    static exfat_set_t set;
+    char name[EXFAT_MAX_NAME + 1];
+    exfat_iter_t it;
+    dir_pos_t pos;
+    uint8_t* entry;
+    exfat_iter_start(&it, &dir);
+    cout << "Directory Listing:\nName          Size\n--------------------\n";
+    while ((entry = exfat_iter_next(ahci_base, port, &it, &pos)) != nullptr) {
+        if (entry[0] == 0x00) return; // End of directory
+        if (entry[0] != EXFAT_ENTRY_FILE || !exfat_read_set(ahci_base, port, &it, entry, pos, &set)) continue;
+        exfat_set_name(&set, name);
+        cout << name;
+        for (int i = simple_strlen(name); i < 14; i++) cout << " ";
+        if (exfat_set_file(&set)->attributes & ATTR_DIRECTORY) cout << "<DIR>\n";
+        else { exfat_print_size(exfat_set_stream(&set)->data_length); cout << "\n"; }
+    }
+    if (it.error) cout << "Error reading directory\n";
+}
+
+void exfat_cat(uint64_t ahci_base, int port, const char* path) {
+    exfat_dir_t dir;
+    char name[EXFAT_MAX_NAME + 1];
+    exfat_set_t set;
+    if (exfat_walk(ahci_base, port, path, &dir, name) != 0 || exfat_find(ahci_base, port, &dir, name, &set) != 0 ||
+        (exfat_set_file(&set)->attributes & ATTR_DIRECTORY)) {
+        cout << "Error: File not found or could not be read.\n";
+        return;
+    }
+    static char chunk[SECTOR_SIZE + 1] __attribute__((aligned(4)));
+    exfat_reader_t reader;
+    exfat_reader_start(&reader, &set);
+    int bytes_read;
+    bool printed = false;
+    while ((bytes_read = exfat_read(ahci_base, port, &reader, (uint8_t*)chunk, SECTOR_SIZE)) > 0) {
+        chunk[bytes_read] = '\0';
+        cout << chunk;
+        printed = true;
+    }
+    if (bytes_read < 0) cout << "\nError: Read failed.";
+    if (printed || bytes_read < 0) cout << "\n";
+}
+
+// Removes a file. Returns 0 on success, -1 on I/O error, -2 if it is missing, -6 if it is
+// a directory.
+int exfat_remove_file(uint64_t ahci_base, int port, const char* path) {
+    exfat_dir_t dir;
+    char name[EXFAT_MAX_NAME + 1];
+    exfat_set_t set;
+    int status = exfat_walk(ahci_base, port, path, &dir, name);
+    if (status == 0) status = exfat_find(ahci_base, port, &dir, name, &set);
+    if (status != 0) return status;
+    if (exfat_set_file(&set)->attributes & ATTR_DIRECTORY) return -6;
+    if (!exfat_begin_update(ahci_base, port)) return -1;
+    for (uint32_t i = 0; i < set.count; i++) set.entries[i][0] &= ~EXFAT_ENTRY_IN_USE;
+    if (!exfat_write_set(ahci_base, port, &set)) return -1;
+    exfat_free_stream(ahci_base, port, exfat_set_stream(&set));
+    return 0;
+}
+
+// Creates 'path' if it is missing. With 'replace', an existing file is rewritten to hold
+// 'data': the new run is written first and then swapped into the file's stream entry, so
+// the old contents are freed only once the new ones are in place. Returns 0 on success or
+// a negative exfat_create() code (-2 also if the name is a directory).
+int exfat_touch(uint64_t ahci_base, int port, const char* path, const void* data, uint32_t size, bool replace) {
+    int status = exfat_create(ahci_base, port, path, size, nullptr, (const uint8_t*)data);
+    if (status != -5) return status;
+    if (!replace) return 0;
+
+    exfat_dir_t dir;
+    char name[EXFAT_MAX_NAME + 1];
+    exfat_set_t set;
+    status = exfat_walk(ahci_base, port, path, &dir, name);
+    if (status == 0) status = exfat_find(ahci_base, port, &dir, name, &set);
+    if (status != 0) return status;
+    if (exfat_set_file(&set)->attributes & ATTR_DIRECTORY) return -2;
+    if (!exfat_begin_update(ahci_base, port)) return -1;
+
+    uint32_t cluster;
+    status = exfat_store(ahci_base, port, size, nullptr, (const uint8_t*)data, &cluster);
+    if (status != 0) return status;
+    exfat_stream_entry_t* stream = exfat_set_stream(&set);
+    exfat_stream_entry_t old_stream = *stream;
+    stream->flags = EXFAT_FLAG_ALLOC_POSSIBLE | (cluster ? EXFAT_FLAG_NO_FAT_CHAIN : 0);
+    stream->valid_data_length = stream->data_length = size;
+    stream->first_cluster = cluster;
+    if (!exfat_write_set(ahci_base, port, &set)) {
+        if (cluster) exfat_mark(cluster, exfat_clusters_for(size), false);
+        return -1;
+    }
+    exfat_free_stream(ahci_base, port, &old_stream);
+    return 0;
+}
+
+// Copies a file into a single contiguous run. Returns 0 on success, -2 if the source is
+// missing, or a negative exfat_create() code.
+int exfat_copy_file(uint64_t ahci_base, int port, const char* src_path, const char* dest_path) {
+    exfat_dir_t dir;
+    char name[EXFAT_MAX_NAME + 1];
+    exfat_set_t set;
+    int status = exfat_walk(ahci_base, port, src_path, &dir, name);
+    if (status == 0) status = exfat_find(ahci_base, port, &dir, name, &set);
+    if (status != 0) return status;
+    if (exfat_set_file(&set)->attributes & ATTR_DIRECTORY) return -2;
+    exfat_reader_t reader;
+    exfat_reader_start(&reader, &set);
+    return exfat_create(ahci_base, port, dest_path, reader.size, &reader, nullptr);
+}
+
+// Commands that only exist for FAT32 volumes.
+static bool exfat_unsupported(const char* cmd) {
+    static const char* const fat32_only[] = { "cd", "mkdir", "rmdir", "mv", "append", "notepad", "chkdsk", "fsinfo", "fstrim", "compress", "uncompress", "sum", "scrub" };
+    for (uint32_t i = 0; i < sizeof(fat32_only) / sizeof(fat32_only[0]); i++) if (stricmp(cmd, fat32_only[i]) == 0) return true;
+    return false;
+}
+
 
 // --- COMMAND IMPLEMENTATIONS ---
 
 bool fat32_format(uint64_t ahci_base, int port, uint32_t total_sectors, uint8_t sectors_per_cluster); // Defined above
+
+// Picks sectors per cluster: larger clusters on larger volumes for longer sequential runs
+// and fewer FAT lookups, raised until the free cluster map can cover the volume, never
+// below the physical sector size, and lowered again if FAT32's cluster minimum demands it.
+static uint8_t choose_cluster_size(uint32_t total_sectors, uint32_t physical_sectors) {
+    uint32_t spc;
+    if (total_sectors >= 134217728) spc = 64;      // >= 64 GiB: 32 KiB
+    else if (total_sectors >= 33554432) spc = 32;  // >= 16 GiB: 16 KiB
+    else if (total_sectors >= 2097152) spc = 16;   // >= 1 GiB: 8 KiB
+    else spc = 8;                                  // 4 KiB
+    while (spc < MAX_TRANSFER_SECTORS && total_sectors / spc > FREE_MAP_MAX_CLUSTERS) spc *= 2;
+    while (spc < physical_sectors && spc < MAX_TRANSFER_SECTORS) spc *= 2;
+    while (spc > 1 && total_sectors / spc < 65525 + 65525 / 8) spc /= 2; // Leave room for metadata
+    return (uint8_t)spc;
+}
+
 void cmd_formatfs(uint64_t ahci_base, int port) {
     cout << "=== FAT32 Format Utility ===\n";
-    uint32_t total_sectors = 2097152; // 1GB
-    uint8_t sec_per_clus;
-    if (total_sectors >= 33554432) sec_per_clus = 64; else if (total_sectors >= 16777216) sec_per_clus = 32;
-    else if (total_sectors >= 524288) sec_per_clus = 16; else sec_per_clus = 8;
-    cout << "Disk size: " << ((uint32_t)total_sectors * 512) / (1024 * 1024) << " MB. Cluster size: " << (int)sec_per_clus << " sectors.\n";
+    uint32_t total_sectors = 2097152; // 1GB, used if the drive cannot be identified
+    uint32_t physical_sectors = 1;
+    if (ata_identify(ahci_base, port) == 0) {
+        if (ata_drive_info.logical_sector_size != SECTOR_SIZE) {
+            cout << "Error: Only 512-byte logical sectors are supported.\n";
+            return;
+        }
+        // tot_sec32 limits a FAT32 volume to 2^32 - 1 sectors.
+        total_sectors = (ata_drive_info.total_sectors > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (uint32_t)ata_drive_info.total_sectors;
+        physical_sectors = ata_drive_info.physical_sector_size / SECTOR_SIZE;
+    } else {
+        cout << "Warning: IDENTIFY failed. Assuming a 1 GB disk.\n";
+    }
+    uint8_t sec_per_clus = choose_cluster_size(total_sectors, physical_sectors);
+    cout << "Disk size: " << total_sectors / 2048 << " MB. Cluster size: " << (int)sec_per_clus << " sectors.\n";
+    if (physical_sectors > 1) cout << "Physical sector size: " << physical_sectors * SECTOR_SIZE << " bytes.\n";
     cout << "WARNING: This will erase all data! Continue? (y/N): ";
     char confirm[10]; cin >> confirm;
     if (confirm[0] != 'y' && confirm[0] != 'Y') { cout << "Format cancelled.\n"; return; }
@@ -759,16 +4292,40 @@ void cmd_formatfs(uint64_t ahci_base, int port) {
     else { cout << "\n=== Format Failed! ===\n"; }
 }
 
+void fat32_show_filesystem_info() {
+    uint32_t total_clusters = fat32_max_clusters() - 2;
+    char label[12];
+    simple_memcpy(label, fat32_bpb.vol_lab, 11);
+    label[11] = '\0';
+    cout << "Volume label:      " << label << "\n"
+         << "Bytes per sector:  " << (unsigned int)fat32_bpb.bytes_per_sec << "\n"
+         << "Cluster size:      " << (unsigned int)fat32_bpb.sec_per_clus * fat32_bpb.bytes_per_sec << " bytes\n"
+         << "Total clusters:    " << total_clusters << "\n"
+         << "FAT size:          " << fat32_bpb.fat_sz32 << " sectors x " << (unsigned int)fat32_bpb.num_fats << "\n";
+    if (free_cluster_count == FSINFO_UNKNOWN) {
+        cout << "Free clusters:     unknown\n";
+    } else {
+        cout << "Free clusters:     " << free_cluster_count << " (" << (uint32_t)(((uint64_t)free_cluster_count * fat32_bpb.sec_per_clus) >> 11) << " MB)\n";
+    }
+    cout << "Next free cluster: " << next_free_cluster << "\n";
+}
+
 // --- Add to FORWARD DECLARATIONS ---
 void cmd_cat(uint64_t ahci_base, int port, const char* filename);
 
 // --- COMMAND IMPLEMENTATIONS ---
 void cmd_help() {
     cout << "--- KERNEL COMMANDS ---\n"
-         << "  help, clear, pong, ls, rm, chkdsk\n"
+         << "  help, clear, pong, ls [dir], rm, chkdsk\n"
+         << "  cd [dir], mkdir <dir>, rmdir <dir>\n"
          << "  touch <file> [content], cat <file>\n"
+         << "  append <file> <text>\n"
          << "  cp <src> <dest>, mv <old> <new>\n"
-         << "  formatfs, mount, unmount, fsinfo\n";
+         << "  compress <file>, uncompress <file>\n"
+         << "  sum <file>, scrub [save]\n"
+         << "  formatfs, mount, unmount, fsinfo\n"
+         << "  (exFAT volumes: ls, cat, cp, rm, touch, sync)\n"
+         << "  sync [age <ms>], fstrim\n";
 }
 
 void cmd_cat(uint64_t ahci_base, int port, const char* filename) {
@@ -776,18 +4333,54 @@ void cmd_cat(uint64_t ahci_base, int port, const char* filename) {
         cout << "Usage: cat <filename>\n";
         return;
     }
+    if (exfat_mounted) {
+        exfat_cat(ahci_base, port, filename);
+        return;
+    }
 
-    // Use a static buffer to avoid heap allocation in the kernel if possible
-    static char file_buffer[4096]; 
-
-    int bytes_read = fat32_read_file_to_buffer(ahci_base, port, filename, file_buffer, sizeof(file_buffer));
-
-    if (bytes_read < 0) {
+    int fd = fat32_open(ahci_base, port, filename, false);
+    if (fd < 0) {
         cout << "Error: File not found or could not be read.\n";
-    } else if (bytes_read == 0) {
-        // File is empty, print nothing.
+        return;
+    }
+
+    // Stream the file through a small static buffer so any size can be shown; compressed
+    // files are decoded a block at a time.
+    static char chunk[SECTOR_SIZE + 1];
+    bool printed = false;
+    int bytes_read;
+    if (entry_compressed(&open_files[fd].entry)) {
+        uint32_t size;
+        bytes_read = compress_read_header(ahci_base, port, fd, &size) ? 1 : -1;
+        while (bytes_read > 0 && (bytes_read = compress_read_block(ahci_base, port, fd, compress_raw)) > 0) {
+            compress_raw[bytes_read] = '\0';
+            cout << (const char*)compress_raw;
+            printed = true;
+        }
     } else {
-        cout << file_buffer << "\n";
+        while ((bytes_read = fat32_read(ahci_base, port, fd, chunk, SECTOR_SIZE)) > 0) {
+            chunk[bytes_read] = '\0';
+            cout << chunk;
+            printed = true;
+        }
+    }
+    if (bytes_read < 0) cout << "\nError: Read failed.";
+    if (printed || bytes_read < 0) cout << "\n";
+    fat32_close(ahci_base, port, fd);
+}
+
+// Runs the age-triggered write-back while the shell waits for input.
+static int writeback_port = 0;
+static void writeback_idle() {
+    if (writeback_due && !fat32_sync(ahci_base, writeback_port)) cout << "\nWarning: background write-back failed.\n";
+}
+
+// Rejoins the words parts[first..count) that the prompt's parser split apart.
+static void join_parts(char** parts, int first, int count, char* out) {
+    out[0] = '\0';
+    for (int i = first; i < count; i++) {
+        if (i > first) simple_strcat(out, " ");
+        simple_strcat(out, parts[i]);
     }
 }
 
@@ -801,6 +4394,7 @@ void command_prompt() {
     cout << "Kernel Command Prompt. Type 'help' for commands.\n\n";
 
     while (true) {
+        if (fat32_initialized) cout << current_path;
         cout << "> ";
         cin >> line; // Use getline to read the whole line
 
@@ -835,29 +4429,89 @@ void command_prompt() {
         else if (stricmp(cmd, "clear") == 0) terminal_clear_screen();
         else if (stricmp(cmd, "formatfs") == 0) cmd_formatfs(ahci_base, port);
         else if (stricmp(cmd, "mount") == 0) {
+            if (fat32_initialized && !fat32_sync(ahci_base, port)) cout << "Warning: Failed to write back the mounted volume.\n";
+            input_idle_hook = nullptr;
             if (fat32_init(ahci_base, port)) { 
                 fat32_initialized = true; 
-                cout << "FAT32 mounted.\n"; 
+                writeback_port = port;
+                input_idle_hook = writeback_idle;
+                if (exfat_mounted) cout << "exFAT mounted.\nFree clusters: " << exfat_free_clusters << "\n";
+                else {
+                    cout << "FAT32 mounted.\n"; 
+                    if (free_cluster_count != FSINFO_UNKNOWN) cout << "Free clusters: " << free_cluster_count << "\n";
+                }
             } else { 
                 cout << "Failed to mount. Is disk formatted?\n"; 
             }
         }
         else if (stricmp(cmd, "unmount") == 0) { 
+            if (fat32_initialized && !fat32_sync(ahci_base, port)) cout << "Warning: Failed to write back file system updates.\n";
+            input_idle_hook = nullptr;
             fat32_initialized = false; 
+            exfat_mounted = false;
             cout << "Filesystem unmounted.\n"; 
         }
         else {
             if (!fat32_initialized) {
                  cout << "Filesystem not mounted. Use 'mount' first.\n";
             } else {
-                if (stricmp(cmd, "ls") == 0) fat32_list_files(ahci_base, port);
+                if (exfat_mounted && exfat_unsupported(cmd)) cout << "Not supported on exFAT volumes.\n";
+                else if (stricmp(cmd, "ls") == 0) {
+                    if (exfat_mounted) exfat_list_files(ahci_base, port, arg1);
+                    else fat32_list_files(ahci_base, port, arg1);
+                }
                 else if (stricmp(cmd, "rm") == 0) { 
-                    if(arg1) fat32_remove_file(ahci_base, port, arg1); 
+                    if (arg1 && exfat_mounted) { if (exfat_remove_file(ahci_base, port, arg1) != 0) cout << "Error removing file.\n"; }
+                    else if(arg1) fat32_remove_file(ahci_base, port, arg1); 
                     else cout << "Usage: rm <filename>\n"; 
                 }
+                else if (stricmp(cmd, "touch") == 0) {
+                    if (arg1) {
+                        // With content the file is (re)written; without, it is only created.
+                        static char text[MAX_COMMAND_LENGTH + 2];
+                        join_parts(parts, 2, part_count, text);
+                        uint32_t length = simple_strlen(text);
+                        int status;
+                        if (exfat_mounted) status = exfat_touch(ahci_base, port, arg1, text, length, arg2 != nullptr);
+                        else if (arg2) status = fat32_write_file(ahci_base, port, arg1, text, length);
+                        else {
+                            status = fat32_open(ahci_base, port, arg1, true);
+                            if (status >= 0) status = fat32_close(ahci_base, port, status);
+                        }
+                        if (status != 0) cout << "Error creating file.\n";
+                    } else cout << "Usage: touch <file> [content]\n";
+                }
+                else if (stricmp(cmd, "cd") == 0) {
+                    if (!arg1) cout << current_path << "\n";
+                    else {
+                        int status = fat32_chdir(ahci_base, port, arg1);
+                        if (status == -2) cout << "Directory not found.\n";
+                        else if (status == -7) cout << "Error: Path too long.\n";
+                        else if (status != 0) cout << "Error reading directory.\n";
+                    }
+                }
+                else if (stricmp(cmd, "mkdir") == 0) {
+                    if (arg1) {
+                        int status = fat32_mkdir(ahci_base, port, arg1);
+                        if (status == -5) cout << "Error: Name already exists.\n";
+                        else if (status == -2) cout << "Error: Invalid path.\n";
+                        else if (status == -6) cout << "Error: Disk full.\n";
+                        else if (status != 0) cout << "Error creating directory.\n";
+                    } else cout << "Usage: mkdir <dir>\n";
+                }
+                else if (stricmp(cmd, "rmdir") == 0) {
+                    if (arg1) {
+                        int status = fat32_rmdir(ahci_base, port, arg1);
+                        if (status == -2) cout << "Directory not found.\n";
+                        else if (status == -5) cout << "Error: Directory is in use.\n";
+                        else if (status == -6) cout << "Error: Directory not empty.\n";
+                        else if (status != 0) cout << "Error removing directory.\n";
+                    } else cout << "Usage: rmdir <dir>\n";
+                }
                 else if (stricmp(cmd, "pong") == 0) {
                   start_pong_game();
                 }
+                else if (stricmp(cmd, "fsinfo") == 0) fat32_show_filesystem_info();
                 else if (stricmp(cmd, "chkdsk") == 0) {
                   cmd_chkdsk(ahci_base, port);
                 }
@@ -875,9 +4529,62 @@ void command_prompt() {
                         else cout << "Error renaming file.\n";
                     } else cout << "Usage: mv <old_name> <new_name>\n";
                 }
+                else if (stricmp(cmd, "sync") == 0) {
+                    if (arg1 && stricmp(arg1, "age") == 0 && arg2) {
+                        writeback_age_ms = simple_atou(arg2);
+                        cout << "Write-back age set to " << writeback_age_ms << " ms.\n";
+                    } else if (arg1) {
+                        cout << "Usage: sync [age <ms>]\n";
+                    } else if (!fat32_sync(ahci_base, port)) {
+                        cout << "Error: sync failed.\n";
+                    }
+                }
+                else if (stricmp(cmd, "fstrim") == 0) {
+                    int trimmed = fat32_fstrim(ahci_base, port);
+                    if (trimmed == -2) cout << "Drive does not support TRIM.\n";
+                    else if (trimmed < 0) cout << "Error: TRIM failed.\n";
+                    else cout << "Trimmed " << (uint32_t)trimmed / (2048 / fat32_bpb.sec_per_clus) << " MB (" << trimmed << " clusters).\n";
+                }
+                else if (stricmp(cmd, "append") == 0) {
+                    if (arg1 && arg2) {
+                        // Rejoin the words the parser split apart and end the line.
+                        static char text[MAX_COMMAND_LENGTH + 2];
+                        join_parts(parts, 2, part_count, text);
+                        simple_strcat(text, "\n");
+                        if (fat32_append_file(ahci_base, port, arg1, text, simple_strlen(text)) != 0) cout << "Error appending to file.\n";
+                    } else cout << "Usage: append <file> <text>\n";
+                }
+                else if (stricmp(cmd, "compress") == 0 || stricmp(cmd, "uncompress") == 0) {
+                    if (arg1) {
+                        int status = fat32_set_compressed(ahci_base, port, arg1, stricmp(cmd, "compress") == 0);
+                        if (status == -2) cout << "File not found.\n";
+                        else if (status == -3) cout << "Error: Compressed data is corrupt.\n";
+                        else if (status == -5) cout << "Error: File is open.\n";
+                        else if (status == -6) cout << "Error: Disk full.\n";
+                        else if (status != 0) cout << "Error converting file.\n";
+                    } else cout << "Usage: " << cmd << " <file>\n";
+                }
+                else if (stricmp(cmd, "sum") == 0) {
+                    if (arg1) {
+                        uint32_t crc;
+                        int status = fat32_sum_file(ahci_base, port, arg1, &crc);
+                        if (status == -2) cout << "File not found.\n";
+                        else if (status != 0) cout << "Error reading file.\n";
+                        else {
+                            char hex[9];
+                            format_hex32(crc, hex);
+                            cout << hex << "  " << arg1 << "\n";
+                        }
+                    } else cout << "Usage: sum <file>\n";
+                }
+                else if (stricmp(cmd, "scrub") == 0) {
+                    if (!arg1 || stricmp(arg1, "save") == 0) cmd_scrub(ahci_base, port, arg1 != nullptr);
+                    else cout << "Usage: scrub [save]\n";
+                }
                 else if (stricmp(cmd, "cp") == 0) { // COPY command
                     if(arg1 && arg2) {
-                        if (fat32_copy_file(ahci_base, port, arg1, arg2) == 0) cout << "File copied.\n";
+                        int status = exfat_mounted ? exfat_copy_file(ahci_base, port, arg1, arg2) : fat32_copy_file(ahci_base, port, arg1, arg2);
+                        if (status == 0) cout << "File copied.\n";
                         else cout << "Error copying file.\n";
                     } else cout << "Usage: cp <source> <destination>\n";
                 }